@@ -0,0 +1,318 @@
+/*
+Measures how fast the map and entities are, without opening a window. Nothing
+here needs a gpu, so this can run on a CI machine. Results are printed as JSON
+to stdout, log messages go to stderr as usual.
+
+	$ make bench && ./bench > results.json
+*/
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "config.hpp"
+#include "enemy.hpp"
+#include "entity.hpp"
+#include "int_pair_map.hpp"
+#include "linalg.hpp"
+#include "map.hpp"
+#include "misc.hpp"
+#include "player.hpp"
+#include "terrain.hpp"
+#include "terrain_cache.hpp"
+
+static constexpr uint32_t SEED = 1234;  // same terrain every time, so results are comparable
+static constexpr double SECONDS_PER_TEST = 1.0;
+
+static double counter_in_seconds()
+{
+	return SDL_GetPerformanceCounter() / static_cast<double>(SDL_GetPerformanceFrequency());
+}
+
+// Calls f repeatedly for about SECONDS_PER_TEST, returns how many times per second it ran
+static double repeat_for_a_while(const std::function<void()>& f)
+{
+	double start = counter_in_seconds();
+	double elapsed;
+	long count = 0;
+	do {
+		f();
+		count++;
+	} while ((elapsed = counter_in_seconds() - start) < SECONDS_PER_TEST || count < 3);
+	return count / elapsed;
+}
+
+struct SectionGenerationResult {
+	double generated_per_sec;  // also neighbors that are generated but not prepared
+	double prepared_per_sec;  // usable sections, each needs its 8 neighbors generated
+};
+
+// Sections far away from everything else, so that they aren't generated yet
+static SectionGenerationResult bench_section_generation(Map& map)
+{
+	MapStats before = map.get_stats();
+	double start = counter_in_seconds();
+	for (int x = 0; x < 4; x++)
+		for (int z = 0; z < 4; z++)
+			map.get_height(100000 + 40*x + 20, 40*z + 20);
+	double elapsed = counter_in_seconds() - start;
+
+	MapStats after = map.get_stats();
+	return SectionGenerationResult{
+		(after.sections - before.sections) / elapsed,
+		(after.sync_preparations - before.sync_preparations) / elapsed,
+	};
+}
+
+static double bench_get_height(Map& map)
+{
+	CounterRandom random(SEED, 1, 0);
+	std::vector<vec2> points;
+	for (int i = 0; i < 4096; i++)
+		points.push_back(vec2{ random.uniform_float(-100, 100), random.uniform_float(-100, 100) });
+	for (vec2 p : points)
+		map.get_height(p.x, p.y);  // generate before measuring
+
+	volatile float sink = 0;
+	return points.size() * repeat_for_a_while([&]() {
+		float sum = 0;
+		for (vec2 p : points)
+			sum += map.get_height(p.x, p.y);
+		sink = sum;
+	});
+}
+
+// Finding enemies near random points, like collision checking does, with enemies already added
+static double bench_enemy_queries(Map& map)
+{
+	CounterRandom random(SEED, 4, 0);
+	std::vector<vec2> points;
+	for (int i = 0; i < 256; i++)
+		points.push_back(vec2{ random.uniform_float(-VIEW_RADIUS, VIEW_RADIUS), random.uniform_float(-VIEW_RADIUS, VIEW_RADIUS) });
+
+	volatile int sink = 0;
+	return points.size() * repeat_for_a_while([&]() {
+		int count = 0;
+		for (vec2 p : points)
+			map.for_each_enemy_within_circle(p.x, p.y, 10, [&](const Enemy&) { count++; });
+		sink = count;
+	});
+}
+
+// Same points as bench_get_height(), sorted by section like enemies are, with normal vectors too
+static double bench_heights_and_normals(Map& map)
+{
+	CounterRandom random(SEED, 1, 0);
+	std::vector<vec2> points;
+	for (int i = 0; i < 4096; i++)
+		points.push_back(vec2{ random.uniform_float(-100, 100), random.uniform_float(-100, 100) });
+	std::sort(points.begin(), points.end(), [](vec2 a, vec2 b) {
+		return std::make_pair(std::floor(a.x/40), std::floor(a.y/40)) < std::make_pair(std::floor(b.x/40), std::floor(b.y/40));
+	});
+
+	std::vector<float> x, z, heights(points.size());
+	std::vector<vec3> normals(points.size());
+	for (vec2 p : points) {
+		x.push_back(p.x);
+		z.push_back(p.y);
+	}
+
+	volatile float sink = 0;
+	return points.size() * repeat_for_a_while([&]() {
+		map.get_heights_and_normals(points.size(), x.data(), z.data(), heights.data(), normals.data());
+		sink = heights[0] + normals[0].x;
+	});
+}
+
+// How map.cpp looked up sections before IntPairMap, kept here for comparing
+struct UnorderedMapHasher {
+	size_t operator()(const std::pair<int,int>& pair) const {
+		size_t h1 = std::hash<int>{}(pair.first);
+		size_t h2 = std::hash<int>{}(pair.second);
+		return (h1*7907u) ^ (h2*4391u);
+	}
+};
+
+struct SectionIndexResult {
+	double unordered_map_lookups_per_sec;
+	double int_pair_map_lookups_per_sec;
+};
+
+// Lookups of section keys like the map does, about 3/4 of them are found
+static SectionIndexResult bench_section_index()
+{
+	std::unordered_map<std::pair<int, int>, std::unique_ptr<int>, UnorderedMapHasher> unordered;
+	IntPairMap<std::unique_ptr<int>> open_addressing;
+	for (int x = -15; x < 15; x++) {
+		for (int z = -15; z < 15; z++) {
+			unordered[std::make_pair(40*x, 40*z)] = std::make_unique<int>(x+z);
+			open_addressing[std::make_pair(40*x, 40*z)] = std::make_unique<int>(x+z);
+		}
+	}
+
+	CounterRandom random(SEED, 3, 0);
+	std::vector<std::pair<int, int>> keys;
+	for (int i = 0; i < 4096; i++)
+		keys.push_back(std::make_pair(40*((int)(random.next_uint32() % 34) - 17), 40*((int)(random.next_uint32() % 34) - 17)));
+
+	volatile int sink = 0;
+	SectionIndexResult result;
+	result.unordered_map_lookups_per_sec = keys.size() * repeat_for_a_while([&]() {
+		int sum = 0;
+		for (std::pair<int, int> key : keys) {
+			auto found = unordered.find(key);
+			if (found != unordered.end())
+				sum += *found->second;
+		}
+		sink = sum;
+	});
+	result.int_pair_map_lookups_per_sec = keys.size() * repeat_for_a_while([&]() {
+		int sum = 0;
+		for (std::pair<int, int> key : keys) {
+			const std::unique_ptr<int> *found = open_addressing.find(key);
+			if (found)
+				sum += **found;
+		}
+		sink = sum;
+	});
+	return result;
+}
+
+struct PhysicsResult {
+	int enemies;
+	double steps_per_sec;
+};
+
+static PhysicsResult bench_physics(Map& map, int nenemies)
+{
+	vec3 player_location = vec3{ 0, map.get_height(0, 0), 0 };
+	std::vector<EnemyHandle> old_enemies;
+	map.for_each_enemy_within_circle(0, 0, 1000, [&](const Enemy& e) { old_enemies.push_back(e.handle); });
+	map.remove_enemies(old_enemies);
+
+	CounterRandom random(SEED, 2, nenemies);
+	for (int i = 0; i < nenemies; i++) {
+		float x = random.uniform_float(-VIEW_RADIUS, VIEW_RADIUS);
+		float z = random.uniform_float(-VIEW_RADIUS, VIEW_RADIUS);
+		map.add_enemy(Enemy(vec3{ x, map.get_height(x, z), z }));
+	}
+
+	float dt = static_cast<float>(MIN_PHYSICS_STEP_SECONDS);
+	map.move_enemies(player_location, dt);  // generate sections that enemies need
+	double steps_per_sec = repeat_for_a_while([&]() { map.move_enemies(player_location, dt); });
+	return PhysicsResult{ nenemies, steps_per_sec };
+}
+
+static double bench_player_update(Map& map)
+{
+	Player player(map.get_height(0, 0));
+	player.entity.set_extra_force(vec3{ PLAYER_MOVING_FORCE, 0, 0 });
+	return repeat_for_a_while([&]() {
+		player.entity.update(map, static_cast<float>(MIN_PHYSICS_STEP_SECONDS));
+		if (player.entity.location.x > 50)
+			player.entity.location.x = -50;  // stay on generated terrain
+	});
+}
+
+// Enemies at different distances, most of them close enough to need the slow check
+static double bench_collisions(Map& map, CollisionMethod method)
+{
+	Player player(map.get_height(0, 0));
+	std::vector<Enemy> enemies;
+	for (int i = 0; i < 16; i++) {
+		float x = 0.5f*i;
+		enemies.push_back(Enemy(vec3{ x, map.get_height(x, 1), 1 }));
+	}
+
+	volatile int sink = 0;
+	return enemies.size() * repeat_for_a_while([&]() {
+		int count = 0;
+		for (const Enemy& e : enemies)
+			count += e.entity.collides_with(player.entity, map, method);
+		sink = count;
+	});
+}
+
+struct CollisionAgreementResult {
+	double agreement;  // how often both methods give the same result
+	int missed_contacts;  // mesh finds a contact, minimizing doesn't
+	int extra_contacts;  // minimizing finds a contact, mesh doesn't
+};
+
+// Compares collision methods for random enemy locations near player
+static CollisionAgreementResult bench_collision_agreement(Map& map)
+{
+	Player player(map.get_height(0, 0));
+	CounterRandom random(SEED, 3, 0);
+	int total = 300;
+	CollisionAgreementResult result = {};
+
+	for (int i = 0; i < total; i++) {
+		float x = random.uniform_float(-6, 6);
+		float z = random.uniform_float(-6, 6);
+		Enemy enemy(vec3{ x, map.get_height(x, z) + random.uniform_float(-1, 2), z });
+		bool minimize = enemy.entity.collides_with(player.entity, map, CollisionMethod::Minimize);
+		bool mesh = enemy.entity.collides_with(player.entity, map, CollisionMethod::Mesh);
+		result.agreement += (minimize == mesh);
+		result.missed_contacts += (mesh && !minimize);
+		result.extra_contacts += (minimize && !mesh);
+	}
+	result.agreement /= total;
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	terrain_cache_set_enabled(false);  // measure generating, not reading files
+	Map map(SEED);
+
+	// Generate the area around origin first, so that it doesn't affect other results
+	map.get_height(0, 0);
+	SectionGenerationResult section_generation = bench_section_generation(map);
+	double get_height_per_sec = bench_get_height(map);
+	double heights_and_normals_per_sec = bench_heights_and_normals(map);
+	SectionIndexResult section_index = bench_section_index();
+	double player_updates_per_sec = bench_player_update(map);
+	std::vector<PhysicsResult> physics;
+	for (int n : { 100, 1000, 10000 })
+		physics.push_back(bench_physics(map, n));
+	double enemy_queries_per_sec = bench_enemy_queries(map);  // with enemies of the last physics test
+	double collision_checks_per_sec = bench_collisions(map, CollisionMethod::Minimize);
+	double mesh_collision_checks_per_sec = bench_collisions(map, CollisionMethod::Mesh);
+	CollisionAgreementResult collision_agreement = bench_collision_agreement(map);
+
+	MapStats stats = map.get_stats();
+	std::printf("{\n");
+	std::printf("  \"seed\": %u,\n", (unsigned)SEED);
+	std::printf("  \"terrain_kernel\": \"%s\",\n", terrain_kernel_name(get_terrain_kernel()));
+	std::printf("  \"worker_threads\": %d,\n", stats.worker_threads);
+	std::printf("  \"sections_per_sec\": { \"generated\": %.2f, \"prepared\": %.2f },\n",
+		section_generation.generated_per_sec, section_generation.prepared_per_sec);
+	std::printf("  \"get_height_per_sec\": %.0f,\n", get_height_per_sec);
+	std::printf("  \"heights_and_normals_per_sec\": %.0f,\n", heights_and_normals_per_sec);
+	std::printf("  \"section_lookups_per_sec\": { \"unordered_map\": %.0f, \"int_pair_map\": %.0f },\n",
+		section_index.unordered_map_lookups_per_sec, section_index.int_pair_map_lookups_per_sec);
+	std::printf("  \"player_updates_per_sec\": %.0f,\n", player_updates_per_sec);
+	std::printf("  \"physics\": [\n");
+	for (int i = 0; i < physics.size(); i++) {
+		std::printf("    { \"enemies\": %d, \"steps_per_sec\": %.2f, \"enemy_updates_per_sec\": %.0f }%s\n",
+			physics[i].enemies, physics[i].steps_per_sec, physics[i].enemies * physics[i].steps_per_sec,
+			i+1 < physics.size() ? "," : "");
+	}
+	std::printf("  ],\n");
+	std::printf("  \"enemy_queries_per_sec\": %.0f,\n", enemy_queries_per_sec);
+	std::printf("  \"collision_checks_per_sec\": %.1f,\n", collision_checks_per_sec);
+	std::printf("  \"mesh_collision_checks_per_sec\": %.1f,\n", mesh_collision_checks_per_sec);
+	std::printf("  \"collision_agreement\": { \"same\": %.3f, \"missed_contacts\": %d, \"extra_contacts\": %d }\n",
+		collision_agreement.agreement, collision_agreement.missed_contacts, collision_agreement.extra_contacts);
+	std::printf("}\n");
+	return 0;
+}
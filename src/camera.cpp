@@ -0,0 +1,52 @@
+#include "camera.hpp"
+#include "config.hpp"
+#include "linalg.hpp"
+
+Frustum::Frustum(const Camera& cam)
+{
+	/*
+	In camera coordinates, a point is visible when -z >= |x|/aspect_ratio and
+	-z >= |y|. This must match locationFromCameraToGlPosition() in the shaders.
+	*/
+	static constexpr float aspect_ratio = WINDOW_WIDTH / (float)WINDOW_HEIGHT;
+	this->planes = {
+		Plane{ vec3{ 1, 0, -aspect_ratio }, 0 },
+		Plane{ vec3{ -1, 0, -aspect_ratio }, 0 },
+		Plane{ vec3{ 0, 1, -1 }, 0 },
+		Plane{ vec3{ 0, -1, -1 }, 0 },
+		Plane{ vec3{ 0, 0, -1 }, 0 },
+	};
+
+	for (Plane& plane : this->planes) {
+		// Unit normals make sphere checks easy. Rotating doesn't change the length.
+		plane.normal /= plane.normal.length();
+
+		// world2cam is the inverse of cam2world, which takes camera coordinates to world directions
+		plane.apply_matrix_INVERSE(cam.world2cam);
+		plane.move(cam.location);
+	}
+}
+
+bool Frustum::sphere_is_visible(vec3 center, float radius) const
+{
+	for (const Plane& plane : this->planes) {
+		// Point of sphere furthest into the visible side
+		if (!plane.whichside(center + plane.normal*radius))
+			return false;
+	}
+	return true;
+}
+
+bool Frustum::box_is_visible(vec3 min, vec3 max) const
+{
+	for (const Plane& plane : this->planes) {
+		vec3 corner = {
+			plane.normal.x > 0 ? max.x : min.x,
+			plane.normal.y > 0 ? max.y : min.y,
+			plane.normal.z > 0 ? max.z : min.z,
+		};
+		if (!plane.whichside(corner))
+			return false;
+	}
+	return true;
+}
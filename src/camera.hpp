@@ -1,6 +1,7 @@
 #ifndef CAMERA_HPP
 #define CAMERA_HPP
 
+#include <array>
 #include "linalg.hpp"
 
 /*
@@ -23,4 +24,20 @@ struct Camera {
 	};
 };
 
+/*
+The part of the world that the camera sees, as planes in world coordinates.
+Everything visible is on the whichside() == true side of every plane, so
+anything fully on the other side of a plane can be skipped when rendering.
+*/
+class Frustum {
+public:
+	Frustum(const Camera& cam);
+
+	bool sphere_is_visible(vec3 center, float radius) const;
+	bool box_is_visible(vec3 min, vec3 max) const;  // box with sides parallel to axes
+
+private:
+	std::array<Plane, 5> planes;  // left, right, bottom, top, behind camera
+};
+
 #endif   // CAMERA_HPP
@@ -8,6 +8,8 @@
 #define CAMERA_MIN_HEIGHT 3  // Won't dip any lower than this amount above map surface
 #define CAMERA_HORIZONTAL_DISTANCE 20
 #define VIEW_RADIUS 80
+#define TERRAIN_LOD_DISTANCE 30  // terrain gets less detailed every this many units away from camera
+#define TERRAIN_16BIT_HEIGHTS 1  // 0 sends heights to gpu as floats, which is more precise but bigger
 
 #define MIN_PHYSICS_STEP_SECONDS 0.02
 #define GRAVITY 20
@@ -17,5 +19,20 @@
 #define PLAYER_TURNING_SPEED 1.8f  // radians per second
 
 #define ENEMY_DELAY 1
+#define MESH_COLLISION 0  // 1 means less precise but faster collision checking
+
+#define WORKER_THREADS 0  // 0 means one less than number of CPU cores
+#define MAP_MEMORY_BUDGET_MB 64  // far away parts of map are deleted to stay below this
+#define TERRAIN_CACHE 1  // save generated terrain to files, so it doesn't need to be generated again
+#define TERRAIN_CACHE_DIR "terraincache"
+#define PREFETCH_FRAMES 60  // how many frames ahead to prepare map sections in the background
+#define PREFETCH_MAX_PENDING_SECTIONS 30  // a bit more than the 25 sections around camera, so whole view fits
+
+#define LOG_LEVEL LOG_INFO  // less important log messages are not shown, see log.hpp
+#define LOG_MAX_PER_SECOND 20  // from each line of code that logs
+
+#define PROFILER 0  // 1 measures how long things take, see profiler.hpp
+#define PROFILER_EVENTS_PER_THREAD 65536  // older events are not included in the trace file
+#define PROFILER_TRACE_FILE "profile.json"
 
 #endif
@@ -1,33 +1,126 @@
 #include "enemy.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <functional>
+#include <vector>
+#include "camera.hpp"
 #include "config.hpp"
 #include "linalg.hpp"
 #include "map.hpp"
 #include "misc.hpp"
+#include "shapes.hpp"
 #include "surface.hpp"
 
-static vec4 tu_to_3d_point_and_brightness(vec2 tu)
-{
-	using std::cos, std::sin;
-	float t = tu.x, u = tu.y;
-	return vec4{ 2*u*cos(t), 6*(1 - u*u) + 0.6f*u*u*u*(1+sin(10*t)), 2*u*sin(t), lerp<float>(0.1f, 0.4f, 1-u) };
-}
-
 static Surface surface = Surface(
-	tu_to_3d_point_and_brightness,
+	EnemyShape(),
 	0, 2*std::acos(-1.0f), 150,
 	0, 1, 10,
 	1.0f, 0.0f, 1.0f);
 
-Enemy::Enemy(vec3 initial_location) : entity{Entity(&surface, initial_location, ENEMY_MAX_SPEED)}
+Enemy::Enemy(vec3 initial_location) : entity{Entity(&surface, initial_location, ENEMY_MAX_SPEED)}, handle{-1, 0}
 { }
 
-void Enemy::move_towards_player(vec3 player_location, Map& map, float dt)
+int Enemy::render_many(const Camera& cam, Map& map, const std::vector<vec3>& locations)
+{
+	return surface.render_many(cam, map, locations.data(), locations.size());
+}
+
+size_t EnemyArrays::get_memory_usage() const
+{
+	return this->handle.capacity()*sizeof(EnemyHandle)
+		+ (this->x.capacity() + this->y.capacity() + this->z.capacity())*sizeof(float)
+		+ (this->speedx.capacity() + this->speedy.capacity() + this->speedz.capacity())*sizeof(float)
+		+ this->touching_ground.capacity();
+}
+
+void EnemyArrays::push_back(const Enemy& enemy)
+{
+	vec3 speed = enemy.entity.get_speed();
+	this->handle.push_back(enemy.handle);
+	this->x.push_back(enemy.entity.location.x);
+	this->y.push_back(enemy.entity.location.y);
+	this->z.push_back(enemy.entity.location.z);
+	this->speedx.push_back(speed.x);
+	this->speedy.push_back(speed.y);
+	this->speedz.push_back(speed.z);
+	this->touching_ground.push_back(enemy.entity.touching_ground);
+	this->version++;
+}
+
+Enemy EnemyArrays::get(int i) const
+{
+	Enemy enemy(vec3{ this->x[i], this->y[i], this->z[i] });
+	enemy.handle = this->handle[i];
+	enemy.entity.set_speed(vec3{ this->speedx[i], this->speedy[i], this->speedz[i] });
+	enemy.entity.touching_ground = this->touching_ground[i];
+	return enemy;
+}
+
+template<typename T> static void swap_remove(std::vector<T>& v, int i)
+{
+	v[i] = v.back();
+	v.pop_back();
+}
+
+void EnemyArrays::remove(int i)
+{
+	swap_remove(this->handle, i);
+	swap_remove(this->x, i);
+	swap_remove(this->y, i);
+	swap_remove(this->z, i);
+	swap_remove(this->speedx, i);
+	swap_remove(this->speedy, i);
+	swap_remove(this->speedz, i);
+	swap_remove(this->touching_ground, i);
+	this->version++;
+}
+
+void EnemyArrays::move_towards_player(vec3 player_location, const float *map_heights, const vec3 *map_normals, float dt)
 {
-	vec3 force = player_location - this->entity.location;
-	force.y = 0;
-	this->entity.set_extra_force(force.with_length(ENEMY_MOVING_FORCE));
-	this->entity.update(map, dt);
+	int n = this->size();
+	float *x = this->x.data(), *y = this->y.data(), *z = this->z.data();
+	float *vx = this->speedx.data(), *vy = this->speedy.data(), *vz = this->speedz.data();
+	uint8_t *touching = this->touching_ground.data();
+	this->version++;
+
+	// Branches are written as multiplying by 0 or 1, so that this loop can use simd
+	for (int i = 0; i < n; i++) {
+		// Force towards player, horizontal
+		float fx = player_location.x - x[i];
+		float fz = player_location.z - z[i];
+		float scale = ENEMY_MOVING_FORCE / std::sqrt(fx*fx + fz*fz);
+		fx *= scale;
+		fz *= scale;
+
+		float on_ground = (y[i] < map_heights[i]) ? 1.0f : 0.0f;
+		touching[i] = (y[i] < map_heights[i]);
+
+		// On ground: stick to ground, don't move into ground, apply friction and moving force
+		float friction = std::min(map_heights[i] - y[i], 1.0f);
+		y[i] = on_ground*map_heights[i] + (1 - on_ground)*y[i];
+
+		vec3 normal = map_normals[i];
+		float projection = (vx[i]*normal.x + vy[i]*normal.y + vz[i]*normal.z) / normal.length_squared();
+		float keep = 1 - on_ground*friction;
+		vx[i] = (vx[i] - on_ground*projection*normal.x)*keep;
+		vy[i] = (vy[i] - on_ground*projection*normal.y)*keep;
+		vz[i] = (vz[i] - on_ground*projection*normal.z)*keep;
+
+		vx[i] += on_ground*fx*dt;
+		vy[i] += -GRAVITY*dt;
+		vz[i] += on_ground*fz*dt;
+
+		x[i] += vx[i]*dt;
+		y[i] += vy[i]*dt;
+		z[i] += vz[i]*dt;
+
+		float speed_squared = vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i];
+		float limit = (speed_squared > ENEMY_MAX_SPEED*ENEMY_MAX_SPEED) ? ENEMY_MAX_SPEED/std::sqrt(speed_squared) : 1.0f;
+		vx[i] *= limit;
+		vy[i] *= limit;
+		vz[i] *= limit;
+	}
 }
 
 void Enemy::decide_location(vec3 player_location, float& x, float& z)
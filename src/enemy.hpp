@@ -1,18 +1,62 @@
 #ifndef ENEMY_HPP
 #define ENEMY_HPP
 
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "camera.hpp"
 #include "linalg.hpp"
 #include "map.hpp"
 #include "entity.hpp"
 
+/*
+Refers to an enemy added to the map. Stays the same when the enemy moves to a
+different section or other enemies are removed. When the enemy is removed, its
+slot can be reused, but with a different generation.
+*/
+struct EnemyHandle {
+	int slot;  // -1 if enemy hasn't been added to the map
+	int generation;
+};
+
 class Enemy {
 public:
 	static void decide_location(vec3 player_location, float& x, float& z);
 	Enemy(vec3 initial_location);
 
+	// Much faster than rendering each enemy separately. Returns how many were visible.
+	static int render_many(const Camera& cam, Map& map, const std::vector<vec3>& locations);
+
 	Entity entity;
+	EnemyHandle handle;  // set by Map::add_enemy()
+};
+
+/*
+Many enemies stored as separate arrays (structure of arrays), so that moving
+all of them can be done with simple loops that the compiler can vectorize.
+Removing swaps the last enemy into the removed enemy's place.
+*/
+class EnemyArrays {
+public:
+	std::vector<EnemyHandle> handle;
+	std::vector<float> x, y, z;
+	std::vector<float> speedx, speedy, speedz;
+	std::vector<uint8_t> touching_ground;
+	int version = 0;  // increases when anything changes
+
+	int size() const { return this->handle.size(); }
+	size_t get_memory_usage() const;
+
+	void push_back(const Enemy& enemy);
+	Enemy get(int i) const;  // returns a copy
+	void remove(int i);
 
-	void move_towards_player(vec3 player_location, Map& map, float dt);
+	/*
+	Same as Entity::update() for every enemy, with force towards the player.
+	map_heights and map_normals must contain map height and normal vector at
+	location of each enemy.
+	*/
+	void move_towards_player(vec3 player_location, const float *map_heights, const vec3 *map_normals, float dt);
 };
 
 #endif
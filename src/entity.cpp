@@ -2,19 +2,23 @@
 #include "config.hpp"
 #include <SDL2/SDL.h>
 #include <algorithm>
+#include <array>
 #include <cmath>
-#include <functional>
 #include <optional>
 #include "linalg.hpp"
 #include "map.hpp"
+#include "log.hpp"
 #include "misc.hpp"
+#include "profiler.hpp"
+#include "shapes.hpp"
 #include "surface.hpp"
 
 
 void Entity::update(Map& map, float dt)
 {
-	float map_height = map.get_height(this->location.x, this->location.z);
-	vec3 normal = map.get_normal_vector(this->location.x, this->location.z);
+	float map_height;
+	vec3 normal;
+	map.get_heights_and_normals(1, &this->location.x, &this->location.z, &map_height, &normal);
 
 	vec3 force = {0, -GRAVITY, 0};
 
@@ -42,10 +46,13 @@ void Entity::update(Map& map, float dt)
 }
 
 
+// F and G are lambda types, not std::function, so that calls to them can be inlined
+template<typename F, typename G>
 class MinimumFinder {
 public:
 	float xmin, xmax, ymin, ymax, zmin, zmax, wmin, wmax;
-	std::function<float(vec4)> f;  // Finds minimum value of this function
+	F f;  // Finds minimum value of this function
+	G gradient;  // Gradient of f, as vec4
 
 	float find_minimum(vec4 starting_point) const
 	{
@@ -59,7 +66,7 @@ public:
 				return f(current);
 
 			float step = find_step_size(current, direction.value());
-			if (step < step_goal || iter++ == 10)
+			if (step < step_goal || iter++ == max_iterations)
 				return f(current);
 			current += direction.value()*step;
 		}
@@ -68,6 +75,13 @@ public:
 private:
 	static constexpr float step_goal = 1e-4f;
 
+	/*
+	Steepest descent zigzags in narrow valleys, and stopping too early misses
+	contacts. More iterations are also often faster, because a contact found
+	sooner means fewer starting points to try.
+	*/
+	static constexpr int max_iterations = 40;
+
 	bool point_is_allowed(vec4 v) const
 	{
 		return xmin<v.x && v.x<xmax
@@ -104,45 +118,119 @@ private:
 
 	std::optional<vec4> find_direction(vec4 current) const
 	{
-		float h = 1e-5f;
-		float fcur = f(current);
-		vec4 gradient = {
-			(f(current + vec4(h,0,0,0)) - fcur)/h,
-			(f(current + vec4(0,h,0,0)) - fcur)/h,
-			(f(current + vec4(0,0,h,0)) - fcur)/h,
-			(f(current + vec4(0,0,0,h)) - fcur)/h,
-		};
-
+		vec4 gradient = this->gradient(current);
 		if (gradient.length_squared() < 1e-3f)
 			return std::nullopt;
 		return gradient * (-1.0f/gradient.length());
 	}
 };
 
-bool Entity::collides_with(const Entity& other, Map& map) const
+// Surfaces collide when some points of them are closer than this
+static constexpr float collision_distance = 0.1f;
+
+// Separating axis test: do the intervals that the boxes project to on the axis overlap?
+static bool boxes_overlap_on_axis(vec3 axis, vec3 center_diff, const std::array<vec3, 3>& axes1, vec3 half1, const std::array<vec3, 3>& axes2, vec3 half2)
 {
-	mat3 this_rotation = this->surface->get_rotation_matrix(map, this->location);
-	mat3 other_rotation = other.surface->get_rotation_matrix(map, other.location);
+	float r1 = std::abs(axes1[0].dot(axis))*half1.x + std::abs(axes1[1].dot(axis))*half1.y + std::abs(axes1[2].dot(axis))*half1.z;
+	float r2 = std::abs(axes2[0].dot(axis))*half2.x + std::abs(axes2[1].dot(axis))*half2.y + std::abs(axes2[2].dot(axis))*half2.z;
+	return std::abs(center_diff.dot(axis)) <= r1 + r2 + collision_distance*axis.length();
+}
+
+/*
+Returns false if the bounding spheres or oriented bounding boxes of the
+entities are further apart than collision_distance. Then the entities
+definitely don't collide, and the slow check isn't needed.
+*/
+static bool bounds_overlap(const Entity& e1, const mat3& rotation1, const Entity& e2, const mat3& rotation2)
+{
+	const SurfaceBounds& b1 = e1.surface->bounds;
+	const SurfaceBounds& b2 = e2.surface->bounds;
+	vec3 center1 = e1.location + rotation1*b1.center;
+	vec3 center2 = e2.location + rotation2*b2.center;
+	vec3 diff = center2 - center1;
+
+	float max_distance = b1.radius + b2.radius + collision_distance;
+	if (diff.length_squared() > max_distance*max_distance)
+		return false;
 
+	std::array<vec3, 3> axes1 = { rotation1*vec3{1,0,0}, rotation1*vec3{0,1,0}, rotation1*vec3{0,0,1} };
+	std::array<vec3, 3> axes2 = { rotation2*vec3{1,0,0}, rotation2*vec3{0,1,0}, rotation2*vec3{0,0,1} };
+
+	// Boxes don't overlap if and only if one of these 15 axes separates them
+	for (int i = 0; i < 3; i++) {
+		if (!boxes_overlap_on_axis(axes1[i], diff, axes1, b1.half_size, axes2, b2.half_size)
+			|| !boxes_overlap_on_axis(axes2[i], diff, axes1, b1.half_size, axes2, b2.half_size))
+		{
+			return false;
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			// Cross product of (nearly) parallel axes is useless, and one of the above axes works instead
+			vec3 axis = axes1[i].cross(axes2[j]);
+			if (axis.length_squared() > 1e-6f && !boxes_overlap_on_axis(axis, diff, axes1, b1.half_size, axes2, b2.half_size))
+				return false;
+		}
+	}
+	return true;
+}
+
+/*
+Approximately, may be bigger than the true minimum if the minimum isn't found.
+Returns as soon as something smaller than good_enough is found.
+*/
+template<typename Shape1, typename Shape2>
+static float minimum_distance_squared(const Entity& e1, const mat3& rotation1, const Entity& e2, const mat3& rotation2, float good_enough)
+{
 	// Computes distance between two points. We want to find out if it can be zero.
-	std::function<float(vec4)> function_to_minimize
-	= [this,&other,&map,&this_rotation,&other_rotation](vec4 input)
+	auto function_to_minimize = [&e1,&e2,&rotation1,&rotation2](vec4 input)
 	{
-		vec3 this_point_raw = this->surface->tu_to_3d_point_and_brightness(input.xy()).xyz();
-		vec3 other_point_raw = other.surface->tu_to_3d_point_and_brightness(input.zw()).xyz();
+		vec3 point1 = e1.location + rotation1*Shape1::tu_to_3d_point_and_brightness(input.xy()).xyz();
+		vec3 point2 = e2.location + rotation2*Shape2::tu_to_3d_point_and_brightness(input.zw()).xyz();
+		return (point1 - point2).length_squared();
+	};
 
-		vec3 this_point = this->location + this_rotation*this_point_raw;
-		vec3 other_point = other.location + other_rotation*other_point_raw;
+	auto gradient = [&e1,&e2,&rotation1,&rotation2,&function_to_minimize](vec4 input)
+	{
+		if constexpr (ShapeHasDerivatives<Shape1>::value && ShapeHasDerivatives<Shape2>::value) {
+			/*
+			f = |diff|^2, where diff = point1 - point2
+			df/da = 2 diff dot d(diff)/da, where a is any of the 4 surface parameters
+			*/
+			vec3 point1 = e1.location + rotation1*Shape1::tu_to_3d_point_and_brightness(input.xy()).xyz();
+			vec3 point2 = e2.location + rotation2*Shape2::tu_to_3d_point_and_brightness(input.zw()).xyz();
+			vec3 diff = (point1 - point2)*2;
 
-		return (this_point - other_point).length_squared();
+			vec3 dt1, du1, dt2, du2;
+			Shape1::tu_to_3d_derivatives(input.xy(), dt1, du1);
+			Shape2::tu_to_3d_derivatives(input.zw(), dt2, du2);
+			return vec4{
+				diff.dot(rotation1*dt1),
+				diff.dot(rotation1*du1),
+				-diff.dot(rotation2*dt2),
+				-diff.dot(rotation2*du2),
+			};
+		} else {
+			float h = 1e-5f;
+			float fcur = function_to_minimize(input);
+			return vec4{
+				(function_to_minimize(input + vec4(h,0,0,0)) - fcur)/h,
+				(function_to_minimize(input + vec4(0,h,0,0)) - fcur)/h,
+				(function_to_minimize(input + vec4(0,0,h,0)) - fcur)/h,
+				(function_to_minimize(input + vec4(0,0,0,h)) - fcur)/h,
+			};
+		}
 	};
 
-	MinimumFinder minimum_finder = {
-		this->surface->tmin, this->surface->tmax,
-		this->surface->umin, this->surface->umax,
-		other.surface->tmin, other.surface->tmax,
-		other.surface->umin, other.surface->umax,
+	const Surface& s1 = *e1.surface;
+	const Surface& s2 = *e2.surface;
+	MinimumFinder<decltype(function_to_minimize), decltype(gradient)> minimum_finder = {
+		s1.tmin, s1.tmax,
+		s1.umin, s1.umax,
+		s2.tmin, s2.tmax,
+		s2.umin, s2.umax,
 		function_to_minimize,
+		gradient,
 	};
 
 	// Don't make this too big, run time is proportional to step_count^4
@@ -153,15 +241,56 @@ bool Entity::collides_with(const Entity& other, Map& map) const
 #define LOOP(NAME) for (int NAME = 0; NAME < step_count; NAME++)
 	LOOP(xstep) LOOP(ystep) LOOP(zstep) LOOP(wstep) {
 		vec4 v = {
-			lerp(this->surface->tmin, this->surface->tmax, (0.5f+xstep)/step_count),
-			lerp(this->surface->umin, this->surface->umax, (0.5f+ystep)/step_count),
-			lerp(other.surface->tmin, other.surface->tmax, (0.5f+zstep)/step_count),
-			lerp(other.surface->umin, other.surface->umax, (0.5f+wstep)/step_count),
+			lerp(s1.tmin, s1.tmax, (0.5f+xstep)/step_count),
+			lerp(s1.umin, s1.umax, (0.5f+ystep)/step_count),
+			lerp(s2.tmin, s2.tmax, (0.5f+zstep)/step_count),
+			lerp(s2.umin, s2.umax, (0.5f+wstep)/step_count),
 		};
-		float value = minimum_finder.find_minimum(v);
-		minvalue = std::min(minvalue, value);
+		minvalue = std::min(minvalue, minimum_finder.find_minimum(v));
+		if (minvalue < good_enough)
+			return minvalue;  // no need to look at other starting points
 	}
 #undef LOOP
 
-	return (minvalue < 0.01f);
+	return minvalue;
+}
+
+// Picks the right template for the shapes, so that shape functions get inlined into the solver
+template<typename Shape1>
+static float minimum_distance_squared(const Entity& e1, const mat3& rotation1, const Entity& e2, const mat3& rotation2, float good_enough)
+{
+	switch(e2.surface->shape) {
+		case ShapeId::Player: return minimum_distance_squared<Shape1, PlayerShape>(e1, rotation1, e2, rotation2, good_enough);
+		case ShapeId::Enemy: return minimum_distance_squared<Shape1, EnemyShape>(e1, rotation1, e2, rotation2, good_enough);
+	}
+	log_printf_abort("unknown shape %d", (int)e2.surface->shape);
+}
+
+static float minimum_distance_squared(const Entity& e1, const mat3& rotation1, const Entity& e2, const mat3& rotation2, float good_enough)
+{
+	switch(e1.surface->shape) {
+		case ShapeId::Player: return minimum_distance_squared<PlayerShape>(e1, rotation1, e2, rotation2, good_enough);
+		case ShapeId::Enemy: return minimum_distance_squared<EnemyShape>(e1, rotation1, e2, rotation2, good_enough);
+	}
+	log_printf_abort("unknown shape %d", (int)e1.surface->shape);
+}
+
+bool Entity::collides_with(const Entity& other, Map& map, CollisionMethod method) const
+{
+	PROFILE_SCOPE("Entity::collides_with");
+	mat3 this_rotation = this->surface->get_rotation_matrix(map, this->location);
+	mat3 other_rotation = other.surface->get_rotation_matrix(map, other.location);
+
+	if (!bounds_overlap(*this, this_rotation, other, other_rotation))
+		return false;
+
+	if (method == CollisionMethod::Mesh) {
+		// Move other mesh to coordinates of this mesh
+		mat3 inverse = this_rotation.transposed();
+		return this->surface->mesh.is_within_distance(
+			other.surface->mesh, inverse*other_rotation, inverse*(other.location - this->location), collision_distance);
+	}
+
+	float threshold = collision_distance*collision_distance;
+	return (minimum_distance_squared(*this, this_rotation, other, other_rotation, threshold) < threshold);
 }
@@ -3,16 +3,30 @@
 
 #include <cmath>
 #include "camera.hpp"  // IWYU pragma: keep
+#include "config.hpp"
 #include "linalg.hpp"
 #include "map.hpp"
 #include "surface.hpp"
 
+/*
+Minimize: find the closest points of the surfaces by minimizing a function of the
+surface parameters. Exact but slow.
+
+Mesh: compare the triangles that are used for rendering the surfaces. Much
+faster, but the triangles are not exactly on the surface.
+*/
+enum class CollisionMethod { Minimize, Mesh };
+
 class Entity {
 public:
-	Entity(Surface* surface, vec3 initial_location, float max_speed = HUGE_VALF) : location(initial_location), surface(surface), max_speed(max_speed) {}
+	Entity(Surface* surface, vec3 initial_location, float max_speed = HUGE_VALF)
+		: location(initial_location), touching_ground(false), surface(surface),
+		  max_speed(max_speed), speed(0, 0, 0), extra_force(0, 0, 0) {}
 
 	vec3 location;
 	inline void set_extra_force(vec3 force) { this->extra_force = force; }
+	inline vec3 get_speed() const { return this->speed; }
+	inline void set_speed(vec3 speed) { this->speed = speed; }
 	void update(Map& map, float dt);
 
 	void render(const Camera& cam, Map& map) const { this->surface->render(cam, map, this->location); }
@@ -20,7 +34,7 @@ public:
 	bool touching_ground;
 	Surface* surface;  // reference caused weird compile errors elsewhere
 
-	bool collides_with(const Entity& other, Map& map) const;
+	bool collides_with(const Entity& other, Map& map, CollisionMethod method = MESH_COLLISION ? CollisionMethod::Mesh : CollisionMethod::Minimize) const;
 
 private:
 	float max_speed;
@@ -0,0 +1,93 @@
+#include "gl_state.hpp"
+#include <GL/glew.h>
+#include <SDL2/SDL.h>
+#include "log.hpp"
+
+#define MAX_TRACKED_ATTRIBUTES 16
+
+int GlState::calls_this_frame = 0;
+
+// Same as opengl's initial state
+static GLuint current_program = 0;
+static GLuint current_array_buffer = 0;
+static GLuint current_element_array_buffer = 0;
+static unsigned enabled_attributes = 0;
+static GLuint attribute_divisors[MAX_TRACKED_ATTRIBUTES] = {0};
+
+static GlCallStats stats = {0, 0, 0};
+
+void GlState::use_program(GLuint program)
+{
+	if (program != current_program) {
+		glUseProgram(program);
+		current_program = program;
+		count_call();
+	}
+}
+
+void GlState::bind_array_buffer(GLuint buffer)
+{
+	if (buffer != current_array_buffer) {
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		current_array_buffer = buffer;
+		count_call();
+	}
+}
+
+// This binding is a part of the vertex array object, but there's only one of those
+void GlState::bind_element_array_buffer(GLuint buffer)
+{
+	if (buffer != current_element_array_buffer) {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+		current_element_array_buffer = buffer;
+		count_call();
+	}
+}
+
+void GlState::enable_attributes(unsigned mask)
+{
+	SDL_assert(mask < (1u << MAX_TRACKED_ATTRIBUTES));
+
+	unsigned changed = mask ^ enabled_attributes;
+	for (int i = 0; changed != 0; i++, changed >>= 1) {
+		if (!(changed & 1))
+			continue;
+		if (mask & (1u << i))
+			glEnableVertexAttribArray(i);
+		else
+			glDisableVertexAttribArray(i);
+		count_call();
+	}
+	enabled_attributes = mask;
+}
+
+void GlState::set_attribute_divisor(GLuint attribute, GLuint divisor)
+{
+	SDL_assert(attribute < MAX_TRACKED_ATTRIBUTES);
+	if (attribute_divisors[attribute] != divisor) {
+		glVertexAttribDivisor(attribute, divisor);
+		attribute_divisors[attribute] = divisor;
+		count_call();
+	}
+}
+
+GLint GlState::get_uniform_location(GLuint program, const char *name)
+{
+	GLint location = glGetUniformLocation(program, name);
+	if (location == -1)
+		log_printf_abort("shader program has no uniform named \"%s\"", name);
+	return location;
+}
+
+void GlState::end_frame()
+{
+	stats.calls_last_frame = calls_this_frame;
+	stats.calls_total += calls_this_frame;
+	stats.frames++;
+	calls_this_frame = 0;
+}
+
+GlCallStats GlState::get_stats()
+{
+	return stats;
+}
@@ -0,0 +1,45 @@
+#ifndef GL_STATE_HPP
+#define GL_STATE_HPP
+
+#include <GL/glew.h>
+
+// Counts an opengl call that doesn't go through GlState, e.g. gl_counted(glClear(...))
+#define gl_counted(CALL) (GlState::count_call(), CALL)
+
+struct GlCallStats {
+	int calls_last_frame;
+	long long calls_total;
+	int frames;
+};
+
+/*
+Opengl remembers the current shader program, bound buffers and enabled vertex
+attributes, so there's no need to set them back to 0 after drawing. These
+functions remember what was set last time and call opengl only when something
+actually changes. All rendering code must use these instead of glUseProgram()
+and friends, otherwise the remembered state would be wrong.
+
+Also counts opengl calls made while rendering, to see how many are left.
+*/
+class GlState {
+public:
+	static void use_program(GLuint program);
+	static void bind_array_buffer(GLuint buffer);
+	static void bind_element_array_buffer(GLuint buffer);
+
+	// Bit i of mask tells whether vertex attribute i should be enabled
+	static void enable_attributes(unsigned mask);
+	static void set_attribute_divisor(GLuint attribute, GLuint divisor);
+
+	// Call once after linking and store the result, not on every frame
+	static GLint get_uniform_location(GLuint program, const char *name);
+
+	static void count_call() { calls_this_frame++; }
+	static void end_frame();
+	static GlCallStats get_stats();
+
+private:
+	static int calls_this_frame;
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef INT_PAIR_MAP_HPP
+#define INT_PAIR_MAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+Hash map with std::pair<int, int> keys, such as section coordinates. All items
+are in one array (open addressing with linear probing), so a lookup usually
+reads one or two cache lines instead of following pointers around like
+std::unordered_map does. Removing an item shifts the items after it back, so
+there are no "deleted" markers that would make lookups slower over time.
+
+Adding and removing can move other items, so pointers to values are valid
+only until the map changes. Use std::unique_ptr values if that's a problem.
+*/
+template<typename T>
+class IntPairMap {
+public:
+	IntPairMap() : slots(16), bits(4), count(0) {}
+
+	size_t size() const { return this->count; }
+
+	// Returns nullptr if not found
+	T *find(std::pair<int, int> key)
+	{
+		Slot& slot = this->slots[this->probe(key)];
+		return slot.used ? &slot.value : nullptr;
+	}
+	const T *find(std::pair<int, int> key) const
+	{
+		const Slot& slot = this->slots[this->probe(key)];
+		return slot.used ? &slot.value : nullptr;
+	}
+
+	// Adds a default constructed value if not found
+	T& operator[](std::pair<int, int> key)
+	{
+		size_t i = this->probe(key);
+		if (!this->slots[i].used) {
+			if (2*(this->count + 1) > this->slots.size()) {
+				this->grow();
+				i = this->probe(key);
+			}
+			this->slots[i].key = key;
+			this->slots[i].used = true;
+			this->count++;
+		}
+		return this->slots[i].value;
+	}
+
+	// Returns false if not found
+	bool erase(std::pair<int, int> key)
+	{
+		size_t mask = this->slots.size() - 1;
+		size_t i = this->probe(key);
+		if (!this->slots[i].used)
+			return false;
+
+		// Items after the hole move back, unless that would put them before where they hash to
+		for (size_t j = (i+1) & mask; this->slots[j].used; j = (j+1) & mask) {
+			size_t home = this->home_index(this->slots[j].key);
+			if (((j - home) & mask) >= ((j - i) & mask)) {
+				this->slots[i] = std::move(this->slots[j]);
+				i = j;
+			}
+		}
+
+		this->slots[i].used = false;
+		this->slots[i].value = T();
+		this->count--;
+		return true;
+	}
+
+	// Calls f(key, value) for each item, in no particular order. Don't add or remove in f.
+	template<typename F> void for_each(F f)
+	{
+		for (Slot& slot : this->slots)
+			if (slot.used)
+				f(slot.key, slot.value);
+	}
+	template<typename F> void for_each(F f) const
+	{
+		for (const Slot& slot : this->slots)
+			if (slot.used)
+				f(slot.key, slot.value);
+	}
+
+private:
+	struct Slot {
+		std::pair<int, int> key;
+		bool used = false;
+		T value;
+	};
+
+	std::vector<Slot> slots;  // size is 2^bits, and at most half of them are used
+	int bits;
+	size_t count;
+
+	size_t home_index(std::pair<int, int> key) const
+	{
+		uint64_t k = ((uint64_t)(uint32_t)key.first << 32) | (uint32_t)key.second;
+		// Fibonacci hashing: multiplying mixes all bits of the key into the top bits
+		return (size_t)((k * 0x9E3779B97F4A7C15ull) >> (64 - this->bits));
+	}
+
+	// Returns index of the key, or the empty slot where it would go
+	size_t probe(std::pair<int, int> key) const
+	{
+		size_t mask = this->slots.size() - 1;
+		size_t i = this->home_index(key);
+		while (this->slots[i].used && this->slots[i].key != key)
+			i = (i+1) & mask;
+		return i;
+	}
+
+	void grow()
+	{
+		std::vector<Slot> old = std::move(this->slots);
+		this->slots = std::vector<Slot>(2*old.size());
+		this->bits++;
+		for (Slot& slot : old)
+			if (slot.used)
+				this->slots[this->probe(slot.key)] = std::move(slot);
+	}
+};
+
+#endif
@@ -119,6 +119,16 @@ public:
 		};
 	}
 
+	// Inverse of a rotation matrix is its transpose
+	inline mat3 transposed() const
+	{
+		return mat3{
+			this->rows[0][0], this->rows[1][0], this->rows[2][0],
+			this->rows[0][1], this->rows[1][1], this->rows[2][1],
+			this->rows[0][2], this->rows[1][2], this->rows[2][2],
+		};
+	}
+
 	static mat3 rotation_about_y(float angle);
 	static mat3 rotation_about_z(float angle);
 	float det() const;
@@ -0,0 +1,101 @@
+#ifndef LOCKFREE_QUEUE_HPP
+#define LOCKFREE_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+/*
+Fixed size queue that any number of threads can push to and pop from at the same time.
+This is Dmitry Vyukov's bounded MPMC queue:
+https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+Each cell has a sequence number that tells whether it's ready to be written or read.
+Threads claim cells by incrementing enqueue_pos or dequeue_pos with compare-and-swap.
+*/
+template<typename T>
+class LockFreeQueue {
+public:
+	// capacity must be a power of two
+	LockFreeQueue(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1)
+	{
+		for (size_t i = 0; i < capacity; i++)
+			this->cells[i].sequence.store(i, std::memory_order_relaxed);
+		this->enqueue_pos.store(0, std::memory_order_relaxed);
+		this->dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+	LockFreeQueue(const LockFreeQueue&) = delete;
+
+	// Returns false if queue is full
+	bool push(T&& value)
+	{
+		Cell *cell;
+		size_t pos = this->enqueue_pos.load(std::memory_order_relaxed);
+		while(1) {
+			cell = &this->cells[pos & this->mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+			if (diff == 0) {
+				if (this->enqueue_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = this->enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data = std::move(value);
+		cell->sequence.store(pos+1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns false if queue is empty
+	bool pop(T& result)
+	{
+		Cell *cell;
+		size_t pos = this->dequeue_pos.load(std::memory_order_relaxed);
+		while(1) {
+			cell = &this->cells[pos & this->mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos+1);
+			if (diff == 0) {
+				if (this->dequeue_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+					break;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = this->dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		result = std::move(cell->data);
+		cell->data = T();  // don't keep e.g. captured stuff alive
+		cell->sequence.store(pos + this->mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Can be off by a bit when other threads are pushing or popping
+	size_t approximate_size() const
+	{
+		size_t enq = this->enqueue_pos.load(std::memory_order_relaxed);
+		size_t deq = this->dequeue_pos.load(std::memory_order_relaxed);
+		return enq > deq ? enq - deq : 0;
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+
+	// separate cache lines, so that pushing and popping threads don't slow each other down
+	alignas(64) std::atomic<size_t> enqueue_pos;
+	alignas(64) std::atomic<size_t> dequeue_pos;
+};
+
+#endif
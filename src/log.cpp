@@ -0,0 +1,134 @@
+#include "log.hpp"
+#include <SDL2/SDL.h>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include "config.hpp"
+#include "lockfree_queue.hpp"
+
+struct LogEntry {
+	LogLevel level;
+	char text[500];  // longer messages get cut
+};
+
+class Logger {
+public:
+	LockFreeQueue<LogEntry> queue;
+	SDL_sem *messages_available;  // posted once for each queued message
+	std::atomic<int> dropped;  // because queue was full
+
+	Logger() : queue(1024), dropped(0)
+	{
+		// We check LOG_LEVEL ourselves, so SDL shouldn't hide debug messages
+		SDL_LogSetPriority(SDL_LOG_CATEGORY_APPLICATION, SDL_LOG_PRIORITY_DEBUG);
+
+		this->messages_available = SDL_CreateSemaphore(0);
+		SDL_assert(this->messages_available);
+		SDL_Thread *thread = SDL_CreateThread(logging_thread, "LoggingThread", this);
+		SDL_assert(thread);
+		SDL_DetachThread(thread);
+
+		// Print what's left when the program exits, the logging thread may not get to it
+		std::atexit(log_flush);
+	}
+
+	// Any thread can do this, including the logging thread
+	void print_queued_messages()
+	{
+		LogEntry entry;
+		while (this->queue.pop(entry))
+			print(entry.level, "%s", entry.text);
+
+		int n = this->dropped.exchange(0);
+		if (n != 0)
+			print(LOG_WARNING, "Log queue was full, %d messages were dropped", n);
+	}
+
+private:
+	static void print(LogLevel level, const char *fmt, ...) SDL_PRINTF_VARARG_FUNC(2)
+	{
+		static const SDL_LogPriority priorities[] = {
+			SDL_LOG_PRIORITY_DEBUG, SDL_LOG_PRIORITY_INFO, SDL_LOG_PRIORITY_WARN, SDL_LOG_PRIORITY_ERROR,
+		};
+		va_list ap;
+		va_start(ap, fmt);
+		SDL_LogMessageV(SDL_LOG_CATEGORY_APPLICATION, priorities[level], fmt, ap);
+		va_end(ap);
+	}
+
+	static int logging_thread(void *loggerptr)
+	{
+		SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+		Logger *logger = (Logger *)loggerptr;
+		while (1) {
+			SDL_SemWaitTimeout(logger->messages_available, 100);
+			logger->print_queued_messages();
+		}
+		return 0;
+	}
+};
+
+static Logger& get_logger()
+{
+	// Never deleted, because things may be logged while other static objects are destroyed
+	static Logger *logger = new Logger();
+	return *logger;
+}
+
+// Returns how many messages were suppressed before this one, or -1 if this one is suppressed
+static int check_rate_limit(LogRateLimit& limit)
+{
+	Uint32 second = SDL_GetTicks() / 1000;
+	if (limit.second.exchange(second) != second)
+		limit.count = 0;
+
+	if (limit.count++ >= LOG_MAX_PER_SECOND) {
+		limit.suppressed++;
+		return -1;
+	}
+	return limit.suppressed.exchange(0);
+}
+
+static void queue_message(LogLevel level, int suppressed, const char *fmt, va_list ap)
+{
+	LogEntry entry;
+	entry.level = level;
+	int len = std::vsnprintf(entry.text, sizeof entry.text, fmt, ap);
+	if (suppressed > 0 && len >= 0 && len < (int)sizeof entry.text)
+		std::snprintf(entry.text + len, sizeof entry.text - len, " (and %d similar messages not shown)", suppressed);
+
+	Logger& logger = get_logger();
+	if (logger.queue.push(std::move(entry)))
+		SDL_SemPost(logger.messages_available);
+	else
+		logger.dropped++;
+}
+
+void log_message(LogLevel level, LogRateLimit& limit, const char *fmt, ...)
+{
+	int suppressed = check_rate_limit(limit);
+	if (suppressed < 0)
+		return;
+
+	va_list ap;
+	va_start(ap, fmt);
+	queue_message(level, suppressed, fmt, ap);
+	va_end(ap);
+}
+
+void log_message_and_abort(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	queue_message(LOG_ERROR, 0, fmt, ap);
+	va_end(ap);
+
+	log_flush();
+	std::abort();
+}
+
+void log_flush()
+{
+	get_logger().print_queued_messages();
+}
@@ -2,12 +2,48 @@
 #define LOG_HPP
 
 #include <SDL2/SDL.h>      // IWYU pragma: keep
+#include <atomic>
+#include "config.hpp"
+
+/*
+Log messages are put to a queue, and a background thread prints them, so
+logging doesn't wait for the terminal. If the queue is full, the message is
+dropped and counted instead of waiting.
+
+Each call site (each log_printf() etc in the code) shows at most
+LOG_MAX_PER_SECOND messages per second. The rest are counted, and the count is
+shown with the next message that gets through. Messages less important than
+LOG_LEVEL are skipped without even formatting them.
+*/
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR };
+
+// One of these for each call site, see log_at_level()
+struct LogRateLimit {
+	std::atomic<Uint32> second;
+	std::atomic<int> count;  // messages during that second
+	std::atomic<int> suppressed;  // not shown because of the limit
+};
+
+void log_message(LogLevel level, LogRateLimit& limit, SDL_PRINTF_FORMAT_STRING const char *fmt, ...) SDL_PRINTF_VARARG_FUNC(3);
+[[noreturn]] void log_message_and_abort(SDL_PRINTF_FORMAT_STRING const char *fmt, ...) SDL_PRINTF_VARARG_FUNC(1);
+void log_flush();  // prints everything in the queue before returning
 
 // https://stackoverflow.com/a/5459929
 #define LOG_STR_HELPER(x) #x
 #define LOG_STR(x) LOG_STR_HELPER(x)
 
-#define log_printf(...) SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION, __FILE__ ":" LOG_STR(__LINE__) ": " __VA_ARGS__)
-#define log_printf_abort(...) (log_printf(__VA_ARGS__), abort())
+// The lambda gives each call site its own static LogRateLimit
+#define log_at_level(LEVEL, ...) ( \
+	(LEVEL) >= LOG_LEVEL \
+	? log_message((LEVEL), []() -> LogRateLimit& { static LogRateLimit limit; return limit; }(), __FILE__ ":" LOG_STR(__LINE__) ": " __VA_ARGS__) \
+	: (void)0)
+
+#define log_debug(...) log_at_level(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at_level(LOG_INFO, __VA_ARGS__)
+#define log_printf(...) log_at_level(LOG_WARNING, __VA_ARGS__)
+#define log_error(...) log_at_level(LOG_ERROR, __VA_ARGS__)
+
+// Not rate limited, prints everything queued before aborting
+#define log_printf_abort(...) log_message_and_abort(__FILE__ ":" LOG_STR(__LINE__) ": " __VA_ARGS__)
 
 #endif
@@ -1,17 +1,22 @@
 #include <GL/glew.h>
 #include <SDL2/SDL.h>
 #include <algorithm>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <vector>
 #include "config.hpp"
 #include "enemy.hpp"
+#include "gl_state.hpp"
 #include "linalg.hpp"
 #include "log.hpp"
 #include "map.hpp"
 #include "opengl_boilerplate.hpp"
 #include "entity.hpp"
 #include "player.hpp"
+#include "profiler.hpp"
 
 static double counter_in_seconds()
 {
@@ -24,7 +29,11 @@ struct GameState {
 	float camera_angle;
 	double start_time = counter_in_seconds();
 	double next_enemy_time = counter_in_seconds();
+	std::vector<vec3> enemy_locations;  // reused every frame for rendering
+	int enemies_drawn_last_frame = 0;  // the rest of enemy_locations were not visible
+	std::vector<EnemyHandle> colliding_enemies;  // reused every frame
 
+	GameState(uint32_t seed) : map(seed) {}
 	GameState(const GameState &) = delete;
 
 	void add_enemy_if_needed() {
@@ -44,7 +53,7 @@ struct GameState {
 		double enemy_delay = 1/(1 + minutes_passed);
 		this->next_enemy_time += enemy_delay;
 
-		log_printf("Added an enemy, now there are %d enemies and next adding will happen after %.2fsec",
+		log_info("Added an enemy, now there are %d enemies and next adding will happen after %.2fsec",
 			(int)this->map.get_number_of_enemies(), enemy_delay);
 	}
 
@@ -52,51 +61,100 @@ struct GameState {
 		this->player.move_and_turn(z_direction, angle_direction, this->map, dt);
 		this->map.move_enemies(this->player.entity.location, dt);
 	}
+
+	void prefetch_map(float frame_time) {
+		vec3 heading = this->player.camera.cam2world * vec3{0, 0, -1};
+		this->map.prefetch(this->player.camera.location, this->player.entity.get_speed(), heading, PREFETCH_FRAMES*frame_time);
+	}
 };
 
 int main(int argc, char **argv)
 {
-	(void)argc;
-	(void)argv;
-
 	std::srand(std::time(nullptr));
 
+	uint32_t seed = std::rand();
+	float prebake_radius = 0;
+	for (int i = 1; i < argc; i++) {
+		if (std::strcmp(argv[i], "--seed") == 0 && i+1 < argc) {
+			seed = std::strtoul(argv[++i], nullptr, 10);
+		} else if (std::strcmp(argv[i], "--prebake") == 0 && i+1 < argc) {
+			prebake_radius = std::strtof(argv[++i], nullptr);
+		} else {
+			std::fprintf(stderr, "Usage: %s [--seed NUMBER] [--prebake RADIUS]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (prebake_radius > 0) {
+		// Fill terrain cache and exit, no window needed
+		Map map(seed);
+		map.prebake(prebake_radius);
+		return 0;
+	}
+
 	OpenglBoilerplate boilerplate = {};
-	GameState game_state = {};
+	GameState game_state(seed);
 
 	int zdir = 0;
 	int angledir = 0;
 
 	double last_time = counter_in_seconds();
+	profiler_set_thread_name("Main thread");
 
 	while (1) {
-		for (double rem = counter_in_seconds() - last_time; rem > 0; rem -= MIN_PHYSICS_STEP_SECONDS)
 		{
-			float dt = static_cast<float>(std::min(rem, MIN_PHYSICS_STEP_SECONDS));
-			game_state.update_physics(zdir, angledir, dt);
+			PROFILE_SCOPE("Frame");
+			double frame_time = counter_in_seconds() - last_time;
+			for (double rem = frame_time; rem > 0; rem -= MIN_PHYSICS_STEP_SECONDS)
+			{
+				float dt = static_cast<float>(std::min(rem, MIN_PHYSICS_STEP_SECONDS));
+				game_state.update_physics(zdir, angledir, dt);
+			}
+			last_time = counter_in_seconds();
+
+			game_state.prefetch_map(static_cast<float>(frame_time));
+
+			game_state.add_enemy_if_needed();
+
+			gl_counted(glClearColor(0, 0, 0, 0));
+			gl_counted(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
+			game_state.map.render(game_state.player.camera);
+			game_state.player.entity.render(game_state.player.camera, game_state.map);
+
+			game_state.enemy_locations.clear();
+			game_state.map.for_each_enemy_within_circle(game_state.player.entity.location.x, game_state.player.entity.location.z, VIEW_RADIUS, [&](const Enemy& e) {
+				game_state.enemy_locations.push_back(e.entity.location);
+			});
+			game_state.enemies_drawn_last_frame = Enemy::render_many(game_state.player.camera, game_state.map, game_state.enemy_locations);
+			SDL_GL_SwapWindow(boilerplate.window);
+			GlState::end_frame();
+
+			game_state.colliding_enemies.clear();
+			game_state.map.for_each_colliding_enemy(game_state.player.entity, [&](const Enemy& e) {
+				game_state.colliding_enemies.push_back(e.handle);
+			});
+			game_state.map.remove_enemies(game_state.colliding_enemies);
 		}
-		last_time = counter_in_seconds();
-
-		game_state.add_enemy_if_needed();
-
-		glClearColor(0, 0, 0, 0);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		game_state.map.render(game_state.player.camera);
-		game_state.player.entity.render(game_state.player.camera, game_state.map);
-
-		for (const Enemy* e : game_state.map.find_enemies_within_circle(game_state.player.entity.location.x, game_state.player.entity.location.z, VIEW_RADIUS))
-		{
-			e->entity.render(game_state.player.camera, game_state.map);
-		}
-		SDL_GL_SwapWindow(boilerplate.window);
-
-		std::vector<const Enemy *> colliding_enemies = game_state.map.find_colliding_enemies(game_state.player.entity);
-		game_state.map.remove_enemies(colliding_enemies);
+		profiler_end_frame();  // after the frame scope ends, so that it is included
 
 		SDL_Event e;
 		while (SDL_PollEvent(&e)) switch(e.type) {
 			case SDL_QUIT:
+			{
+				MapStats stats = game_state.map.get_stats();
+				log_printf("Quitting. Map has %d sections (%.1f MB, %d evicted), %d generated and %d prepared while waiting, %d sections prefetched, %d loaded from cache.",
+					stats.sections, stats.memory_bytes / (1024.0*1024.0), stats.sections_evicted, stats.sync_generations, stats.sync_preparations, stats.prefetched, stats.sections_from_cache);
+				log_printf("Sent %.1f KB of terrain to gpu per frame on average, drew %d terrain triangles on last frame.",
+					stats.upload_bytes_total / 1024.0 / std::max(stats.frames_rendered, 1), stats.triangles_last_frame);
+				log_printf("On last frame, culled %d of %d terrain sections and %d of %d enemies within view radius.",
+					stats.sections_culled_last_frame, stats.sections_culled_last_frame + stats.sections_drawn_last_frame,
+					(int)game_state.enemy_locations.size() - game_state.enemies_drawn_last_frame, (int)game_state.enemy_locations.size());
+				GlCallStats gl_stats = GlState::get_stats();
+				log_printf("Made %.1f opengl calls per frame on average, %d on last frame.",
+					gl_stats.calls_total / (double)std::max(gl_stats.frames, 1), gl_stats.calls_last_frame);
+				profiler_finish();
 				return 0;
+			}
 
 			case SDL_KEYDOWN:
 				switch(e.key.keysym.scancode) {
@@ -3,9 +3,13 @@
 #include <SDL2/SDL.h>
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <functional>
 #include <memory>
+#include <string>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -13,29 +17,67 @@
 #include "config.hpp"
 #include "entity.hpp"
 #include "enemy.hpp"
+#include "gl_state.hpp"
+#include "int_pair_map.hpp"
 #include "linalg.hpp"
 #include "log.hpp"
 #include "misc.hpp"
+#include "profiler.hpp"
 #include "opengl_boilerplate.hpp"
+#include "terrain.hpp"
+#include "terrain_cache.hpp"
+#include "threadpool.hpp"
 
 static constexpr int SECTION_SIZE = 40;  // side length of section square on xz plane
 static constexpr int TRIANGLES_PER_SECTION = 2*SECTION_SIZE*SECTION_SIZE;
+static constexpr int VERTICES_PER_SECTION = (SECTION_SIZE + 1)*(SECTION_SIZE + 1);
 
-struct GaussianCurveMountain {
-	float xzscale, yscale, centerx, centerz;
+/*
+Only heights are sent to the gpu, x and z are computed in the vertex shader.
+With 16-bit heights, values are rounded to multiples of 1/HEIGHT_STEPS_PER_UNIT.
+Don't scale them per section, because then neighboring sections would round the
+same height differently and there would be tiny gaps between them.
+*/
+#if TERRAIN_16BIT_HEIGHTS
+typedef int16_t GpuHeight;
+static constexpr int HEIGHT_STEPS_PER_UNIT = 128;
+#else
+typedef float GpuHeight;
+static constexpr int HEIGHT_STEPS_PER_UNIT = 1;
+#endif
+
+static GpuHeight height_for_gpu(float y)
+{
+#if TERRAIN_16BIT_HEIGHTS
+	return (GpuHeight)std::clamp(std::round(y * HEIGHT_STEPS_PER_UNIT), -32768.0f, 32767.0f);
+#else
+	return y;
+#endif
+}
+
+/*
+Enemies of a section sorted into squares, so that finding enemies near a point
+doesn't need to check every enemy of the section. Built again when needed after
+the enemies have changed.
+*/
+static constexpr int ENEMY_GRID_CELL_SIZE = 8;
+static constexpr int ENEMY_GRID_SIZE = SECTION_SIZE / ENEMY_GRID_CELL_SIZE;  // number of cells in each direction
+static_assert(SECTION_SIZE % ENEMY_GRID_CELL_SIZE == 0);
+
+struct EnemyGrid {
+	int version = -1;  // EnemyArrays::version when built
+	std::array<int, ENEMY_GRID_SIZE*ENEMY_GRID_SIZE + 1> cell_begin;  // cell c is indexes[cell_begin[c]] ... indexes[cell_begin[c+1]-1]
+	std::vector<int> indexes;  // indexes to EnemyArrays, one cell at a time
 };
 
 struct Section {
 	Section() = default;
 	Section(const Section&) = delete;
 
-	std::vector<Enemy> enemies;
+	EnemyArrays enemies;
+	mutable EnemyGrid enemy_grid;  // mutable because finding enemies builds it
 
-	/*
-	y = yscale*e^(-(((x - centerx) / xzscale)^2 + ((z - centerz) / xzscale)^2))
-	yscale can be negative, xzscale can't
-	center coords are within the section and relative to section start, not depending on location of section
-	*/
+	// center coords are within the section and relative to section start, not depending on location of section
 	std::array<GaussianCurveMountain, 100> mountains;
 
 	/*
@@ -45,35 +87,61 @@ struct Section {
 		- contains enough values to cover neighbors too
 		- does not take in account neighbors
 		- is slow to compute
-		- is always ready to be used, even when y_table_and_vertexdata_ready is false
+		- is always ready to be used, even when state is not PREPARED
 
-	vertexdata is passed to the gpu for rendering, and represents triangles.
+	gpu_heights is passed to the gpu for rendering. It's y_table in a more compact
+	form, with one height for each vertex. The same index buffer is used for all
+	sections to tell which vertices make up each triangle.
 	*/
 	std::array<std::array<float, 3*SECTION_SIZE + 1>, 3*SECTION_SIZE + 1> raw_y_table;
 	std::array<std::array<float, SECTION_SIZE + 1>, SECTION_SIZE + 1> y_table;
-	std::array<std::array<vec3, 3>, TRIANGLES_PER_SECTION> vertexdata;
-	bool y_table_and_vertexdata_ready;
+	std::array<GpuHeight, VERTICES_PER_SECTION> gpu_heights;
+	float min_height, max_height;  // of y_table, set with gpu_heights
+	std::atomic<int> state;  // one of the values of SectionState
+
+	// Sections can be evicted to save memory, but not while a worker thread uses them.
+	// Mutable because jobs that only read the section also change this.
+	mutable std::atomic<int> jobs_using;
+	int last_used_frame;
 };
 
-static void generate_section(Section& section)
+/*
+Generating means computing mountains and raw_y_table. Preparing means computing
+y_table and gpu_heights. Worker threads can do both when the section will soon
+be needed. Then the state goes through these values in this order. Whoever
+changes state to GENERATING or PREPARING does the work.
+*/
+enum SectionState {
+	QUEUED_FOR_GENERATING,
+	GENERATING,
+	NOT_PREPARED,
+	QUEUED_FOR_PREPARING,
+	PREPARING,
+	PREPARED,
+};
+
+// Everything except raw_y_table, which is filled with compute_raw_y_table_rows()
+static void generate_mountains(Section& section, uint32_t world_seed, int startx, int startz)
 {
-	section.y_table_and_vertexdata_ready = false;
+	// Sections are generated in any order, on any thread, and an evicted section
+	// must come back exactly the same
+	CounterRandom random(world_seed, startx, startz);
 	int i;
 
 	// wide and deep/tall
 	for (i = 0; i < section.mountains.size()/20; i++) {
-		float h = 5*std::tan(uniform_random_float(-1.4f, 1.4f));
-		float w = uniform_random_float(std::abs(h), 3*std::abs(h));
-		section.mountains[i] = GaussianCurveMountain{w, h, uniform_random_float(0, SECTION_SIZE), uniform_random_float(0, SECTION_SIZE)};
+		float h = 5*std::tan(random.uniform_float(-1.4f, 1.4f));
+		float w = random.uniform_float(std::abs(h), 3*std::abs(h));
+		section.mountains[i] = GaussianCurveMountain{w, h, random.uniform_float(0, SECTION_SIZE), random.uniform_float(0, SECTION_SIZE)};
 	}
 
 	// narrow and shallow
 	for (; i < section.mountains.size(); i++) {
-		float h = uniform_random_float(0.25f, 1.5f);
-		float w = uniform_random_float(2*h, 5*h);
-		if (rand() % 2)
+		float h = random.uniform_float(0.25f, 1.5f);
+		float w = random.uniform_float(2*h, 5*h);
+		if (random.next_uint32() % 2)
 			h = -h;
-		section.mountains[i] = GaussianCurveMountain{w, h, uniform_random_float(0, SECTION_SIZE), uniform_random_float(0, SECTION_SIZE)};
+		section.mountains[i] = GaussianCurveMountain{w, h, random.uniform_float(0, SECTION_SIZE), random.uniform_float(0, SECTION_SIZE)};
 	}
 
 	// y=e^(-x^2) seems to be pretty much zero for |x| >= 3.
@@ -89,270 +157,579 @@ static void generate_section(Section& section)
 		});
 		section.mountains[i].xzscale = std::min(section.mountains[i].xzscale, mindist/3);
 	}
+}
 
-	// This loop is too slow to run within a single frame
-	for (int xidx = 0; xidx <= 3*SECTION_SIZE; xidx++) {
-		for (int zidx = 0; zidx <= 3*SECTION_SIZE; zidx++) {
-			int x = xidx - SECTION_SIZE;
-			int z = zidx - SECTION_SIZE;
+static void compute_raw_y_table_rows(Section& section, int xidx_begin, int xidx_end)
+{
+	compute_mountain_heights(
+		section.mountains.data(), section.mountains.size(),
+		xidx_begin - SECTION_SIZE, xidx_end - xidx_begin, -SECTION_SIZE, section.raw_y_table[0].size(),
+		&section.raw_y_table[xidx_begin][0], section.raw_y_table[0].size());
+}
 
-			float y = 0;
-			for (int i = 0; i < section.mountains.size(); i++) {
-				float dx = x - section.mountains[i].centerx;
-				float dz = z - section.mountains[i].centerz;
-				float xzscale = section.mountains[i].xzscale;
-				y += section.mountains[i].yscale * expf(-1/(xzscale*xzscale) * (dx*dx + dz*dz));
-			}
-			section.raw_y_table[xidx][zidx] = y;
+static void generate_section(Section& section, uint32_t world_seed, int startx, int startz)
+{
+	PROFILE_SCOPE("generate_section");
+	generate_mountains(section, world_seed, startx, startz);
+	compute_raw_y_table_rows(section, 0, section.raw_y_table.size());  // too slow to run within a single frame
+	section.state = NOT_PREPARED;
+}
+
+static void compute_gpu_heights(Section& section)
+{
+	section.min_height = section.y_table[0][0];
+	section.max_height = section.y_table[0][0];
+	for (int ix = 0; ix <= SECTION_SIZE; ix++) {
+		for (int iz = 0; iz <= SECTION_SIZE; iz++) {
+			section.gpu_heights[ix*(SECTION_SIZE + 1) + iz] = height_for_gpu(section.y_table[ix][iz]);
+			section.min_height = std::min(section.min_height, section.y_table[ix][iz]);
+			section.max_height = std::max(section.max_height, section.y_table[ix][iz]);
 		}
 	}
+
+	// gpu_heights are rounded, so what gets drawn can be slightly outside the range
+	section.min_height -= 1;
+	section.max_height += 1;
 }
 
 /*
-You typically need many new sections at once, because neighbor sections affect the section
-that needs to be added. There's a separate thread that generates them in the
-background. After generating, a section can be added anywhere on the map.
+Prepared sections are saved to the terrain cache. They don't need neighbors
+after loading. These parts of the section are in the file one after another.
 */
-struct SectionQueue {
-	std::vector<std::unique_ptr<Section>> sections;
-	SDL_mutex *lock;  // hold this while adding/removing/checking sects or len
-	bool quit;
+static constexpr size_t CACHED_PART_SIZES[] = {
+	sizeof(Section::mountains),
+	sizeof(Section::raw_y_table),
+	sizeof(Section::y_table),
 };
+static constexpr int CACHED_PART_COUNT = sizeof(CACHED_PART_SIZES) / sizeof(CACHED_PART_SIZES[0]);
 
-static int section_preparing_thread(void *queueptr)
+// Copies directly from the mmap()ed file to the section
+static bool load_section_from_cache(Section& section, uint32_t world_seed, int startx, int startz)
 {
-	SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
-	SectionQueue *queue = (SectionQueue *)queueptr;
-
-	while (!queue->quit) {
-		int ret = SDL_LockMutex(queue->lock);
-		SDL_assert(ret == 0);
-		int len = queue->sections.size();
-		ret = SDL_UnlockMutex(queue->lock);
-		SDL_assert(ret == 0);
-
-		int maxlen = 30;  // about 4x usual size, in case corner cases do something weird
-		if (len == maxlen) {
-			SDL_Delay(10);
-			continue;
-		}
+	void *parts[] = { &section.mountains, &section.raw_y_table, &section.y_table };
+	static_assert(sizeof(parts)/sizeof(parts[0]) == CACHED_PART_COUNT);
+	if (!terrain_cache_load(world_seed, startx, startz, parts, CACHED_PART_SIZES, CACHED_PART_COUNT))
+		return false;
+
+	compute_gpu_heights(section);
+	section.state = PREPARED;
+	return true;
+}
 
-		//log_printf("There is room in section queue (%d/%d), generating a new section", len, maxlen);
-		std::unique_ptr<Section> tmp = std::make_unique<Section>();
-		generate_section(*tmp);  // slow
+static void save_section_to_cache(const Section& section, uint32_t world_seed, int startx, int startz)
+{
+	const void *parts[] = { &section.mountains, &section.raw_y_table, &section.y_table };
+	static_assert(sizeof(parts)/sizeof(parts[0]) == CACHED_PART_COUNT);
+	terrain_cache_save(world_seed, startx, startz, parts, CACHED_PART_SIZES, CACHED_PART_COUNT);
+}
 
-		ret = SDL_LockMutex(queue->lock);
-		SDL_assert(ret == 0);
-		queue->sections.push_back(std::move(tmp));
-		ret = SDL_UnlockMutex(queue->lock);
-		SDL_assert(ret == 0);
-	}
+/*
+Sections stay on the gpu after rendering, so that they don't need to be sent
+again on the next frame. A section only gets uploaded when it comes into view.
+There are more slots than visible sections, so that moving back and forth
+near a section boundary doesn't upload the same sections over and over.
+*/
+struct GpuSlot {
+	std::pair<int, int> key;
+	int last_used_frame;  // -1 if slot has never been used
+};
 
-	return 1234;  // ignored
-}
+// Index Buffer Object, tells which vertices make up each triangle
+struct LodIndexBuffer {
+	GLuint ibo;
+	int count;  // number of indexes, 3 for each triangle
+};
 
-// pairs aren't hashable :(
-// https://stackoverflow.com/a/32685618
-struct IntPairHasher {
-	size_t operator()(const std::pair<int,int>& pair) const {
-		size_t h1 = std::hash<int>{}(pair.first);
-		size_t h2 = std::hash<int>{}(pair.second);
-		// both magic numbers are primes, to prevent patterns that place many numbers similarly
-		return (h1*7907u) ^ (h2*4391u);
-	}
+struct EnemySlot {
+	std::pair<int, int> section;  // enemies of evicted sections keep the same location
+	int index;  // in EnemyArrays of the section, -1 if slot is not used
+	int generation;  // increases when the enemy is removed, see EnemyHandle
 };
 
 struct MapPrivate {
-	std::unordered_map<std::pair<int, int>, std::unique_ptr<Section>, IntPairHasher> sections;
+	IntPairMap<std::unique_ptr<Section>> sections;
+
+	uint32_t seed;
+	vec3 player_location;  // sections near player are never evicted
 
-	SectionQueue queue;
-	SDL_Thread *prepthread;
+	// Enemies of evicted sections, they come back when section is generated again
+	IntPairMap<EnemyArrays> evicted_enemies;
+	int sections_evicted;
+
+	// Where each enemy is, indexed with EnemyHandle::slot
+	std::vector<EnemySlot> enemy_slots;
+	std::vector<int> free_enemy_slots;
+
+	std::unique_ptr<ThreadPool> pool;
+	std::atomic<int> generation_jobs_pending;
+	std::atomic<int> loaded_from_cache;
+	std::atomic<int> cache_saves_pending;  // low priority jobs writing prepared sections to files
+	int sync_generations;  // how many times a section wasn't generated in background when it was needed
+	int prefetched;  // how many sections were queued for preparing in the background
+	int sync_preparations;  // how many times a section was prepared while the game waits
 
 	GLuint shaderprogram;
-	GLuint vbo;  // Vertex Buffer Object, represents triangles going to gpu
+	GLint camera_location_uniform, world2cam_uniform, section_start_uniform;
+	GLuint vbo;  // Vertex Buffer Object, contains heights going to gpu
+	std::unordered_map<int, LodIndexBuffer> lod_index_buffers;
+	std::vector<GpuSlot> gpu_slots;  // vbo is split into slots, one section in each
+	int frame;  // incremented in each render() call
+	int upload_bytes_last_frame;
+	long long upload_bytes_total;
+	int triangles_last_frame;
+	int sections_drawn_last_frame;
+	int sections_culled_last_frame;  // not visible to camera, see Frustum
 };
 
-static Section *find_or_add_section(MapPrivate& map, int startx, int startz)
+// Splits the slow part into high priority jobs, so that all worker threads help
+static void generate_section_now(MapPrivate& map, Section& section, int startx, int startz)
 {
-	std::pair<int, int> key = { startx, startz };
-
-	if (map.sections.find(std::make_pair(startx, startz)) == map.sections.end()) {
-		int ret = SDL_LockMutex(map.queue.lock);
-		SDL_assert(ret == 0);
+	PROFILE_SCOPE("generate_section_now");
+	generate_mountains(section, map.seed, startx, startz);
+
+	int nrows = section.raw_y_table.size();
+	int rows_per_job = 8;
+	std::atomic<int> remaining((nrows + rows_per_job - 1) / rows_per_job);
+
+	for (int begin = 0; begin < nrows; begin += rows_per_job) {
+		int end = std::min(begin + rows_per_job, nrows);
+		std::function<void()> job = [&section, &remaining, begin, end]() {
+			compute_raw_y_table_rows(section, begin, end);
+			remaining--;
+		};
+		if (!map.pool->submit(job, JobPriority::High))
+			job();
+	}
+	map.pool->wait(remaining);
+	section.state = NOT_PREPARED;
+}
 
-		std::unique_ptr<Section> section = nullptr;
-		if (!map.queue.sections.empty()) {
-			section = std::move(map.queue.sections.end()[-1]);
-			map.queue.sections.pop_back();
+static bool queue_generating(MapPrivate& map, Section *section, int startx, int startz)
+{
+	section->state = QUEUED_FOR_GENERATING;
+	section->jobs_using++;
+	map.generation_jobs_pending++;
+
+	uint32_t seed = map.seed;
+	std::atomic<int> *pending = &map.generation_jobs_pending;
+	std::atomic<int> *loaded = &map.loaded_from_cache;
+	bool ok = map.pool->submit([section, seed, startx, startz, pending, loaded]() {
+		int state = QUEUED_FOR_GENERATING;
+		if (section->state.compare_exchange_strong(state, GENERATING)) {
+			if (load_section_from_cache(*section, seed, startx, startz))
+				(*loaded)++;
+			else
+				generate_section(*section, seed, startx, startz);  // slow
 		}
+		section->jobs_using--;
+		(*pending)--;
+	});
+
+	if (!ok) {
+		section->jobs_using--;
+		map.generation_jobs_pending--;
+	}
+	return ok;
+}
 
-		ret = SDL_UnlockMutex(map.queue.lock);
-		SDL_assert(ret == 0);
+/*
+You typically need many new sections at once, because neighbor sections affect
+the section that needs to be added. So sections are usually generated in worker
+threads before they are needed, see Map::prefetch().
 
-		if (!section) {
-			log_printf("Section queue was empty, generating a section outside queue");
-			section = std::make_unique<Section>();
-			generate_section(*section);  // slow
+If may_generate_now is false, this doesn't do anything slow. The section is
+queued for generating if needed, and nullptr is returned if it isn't ready yet.
+*/
+static Section *find_or_add_section(MapPrivate& map, int startx, int startz, bool may_generate_now = true)
+{
+	std::pair<int, int> key = { startx, startz };
+	std::unique_ptr<Section> *found = map.sections.find(key);
+	Section *section;
+
+	if (!found) {
+		if (!may_generate_now && map.generation_jobs_pending >= PREFETCH_MAX_PENDING_SECTIONS)
+			return nullptr;  // don't fill the job queue with sections that might not be needed
+
+		std::unique_ptr<Section>& added = map.sections[key];
+		added = std::make_unique<Section>();
+		section = added.get();
+		section->state = QUEUED_FOR_GENERATING;
+		section->jobs_using = 0;
+
+		EnemyArrays *evicted = map.evicted_enemies.find(key);
+		if (evicted) {
+			section->enemies = std::move(*evicted);
+			map.evicted_enemies.erase(key);
+		}
+
+		if (!may_generate_now) {
+			if (!queue_generating(map, section, startx, startz))
+				section->state = QUEUED_FOR_GENERATING;  // will be generated when needed
+			return nullptr;
 		}
+	} else {
+		section = found->get();
+	}
+	section->last_used_frame = map.frame;
+
+	int state = section->state;
+	if (state == QUEUED_FOR_GENERATING) {
+		if (!may_generate_now)
+			return nullptr;
+		if (section->state.compare_exchange_strong(state, GENERATING)) {
+			if (load_section_from_cache(*section, map.seed, startx, startz)) {
+				map.loaded_from_cache++;
+				return section;
+			}
+			map.sync_generations++;
+			log_printf("Generating a section that wasn't generated in background (%d times so far)", map.sync_generations);
+			generate_section_now(map, *section, startx, startz);  // slow
+		}
+	}
 
-		map.sections[key] = std::move(section);
-		log_printf("added a section, map now has %d sections", (int)map.sections.size());
+	if (section->state < NOT_PREPARED) {
+		if (!may_generate_now)
+			return nullptr;
+		// A worker thread is generating it right now
+		map.pool->wait_until([section]() { return section->state >= NOT_PREPARED; });
 	}
 
-	return &*map.sections[key];
+	return section;
 }
 
-static void ensure_y_table_is_ready(MapPrivate& map, int startx, int startz)
+static size_t get_memory_usage(const Section& section)
 {
-	SDL_assert(map.sections.find(std::make_pair(startx, startz)) != map.sections.end());
-	Section *section = map.sections[std::make_pair(startx, startz)].get();
-	if (section->y_table_and_vertexdata_ready)
+	return sizeof(section) + section.enemies.get_memory_usage();
+}
+
+/*
+When the map uses more memory than MAP_MEMORY_BUDGET_MB, sections far away from
+the player are deleted, starting with the one that was used longest ago. They
+are generated again if needed. Enemies of evicted sections are kept.
+*/
+static void evict_sections_if_needed(MapPrivate& map)
+{
+	constexpr size_t budget = (size_t)MAP_MEMORY_BUDGET_MB * 1024 * 1024;
+	if (map.sections.size()*sizeof(Section) < budget)  // quick check, usually enough
+		return;
+
+	size_t usage = 0;
+	std::vector<std::pair<int, int>> candidates = {};
+	map.sections.for_each([&](std::pair<int, int> key, const std::unique_ptr<Section>& section) {
+		usage += get_memory_usage(*section);
+
+		// move_enemies() needs sections within 2*VIEW_RADIUS, and their neighbors
+		vec2 center = vec2(key.first + SECTION_SIZE/2, key.second + SECTION_SIZE/2);
+		float keep_radius = 2*VIEW_RADIUS + 2*SECTION_SIZE;
+		bool near_player = (center - vec2(map.player_location.x, map.player_location.z)).length_squared() < keep_radius*keep_radius;
+
+		if (!near_player && section->last_used_frame != map.frame && section->jobs_using == 0)
+			candidates.push_back(key);
+	});
+	if (usage < budget)
 		return;
 
+	std::sort(candidates.begin(), candidates.end(), [&map](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+		return (*map.sections.find(a))->last_used_frame < (*map.sections.find(b))->last_used_frame;
+	});
+
+	// Evict a bit more than needed, so that this doesn't run on every frame
+	int count = 0;
+	for (const std::pair<int, int>& key : candidates) {
+		if (usage < budget*9/10)
+			break;
+		Section& section = **map.sections.find(key);
+		usage -= get_memory_usage(section);
+
+		if (section.enemies.size() != 0)
+			map.evicted_enemies[key] = std::move(section.enemies);
+		map.sections.erase(key);
+		count++;
+	}
+
+	map.sections_evicted += count;
+	log_printf("Evicted %d sections, map now has %d sections", count, (int)map.sections.size());
+}
+
+// neighbors[1][1] is the section itself
+typedef std::array<std::array<const Section*, 3>, 3> Neighbors;
+
+// Returns false if may_generate_now is false and sections are missing
+static bool find_neighbors(MapPrivate& map, int startx, int startz, Neighbors& neighbors, bool may_generate_now = true)
+{
+	for (int xdiff = -SECTION_SIZE; xdiff <= SECTION_SIZE; xdiff += SECTION_SIZE) {
+		for (int zdiff = -SECTION_SIZE; zdiff <= SECTION_SIZE; zdiff += SECTION_SIZE) {
+			Section *s = find_or_add_section(map, startx + xdiff, startz + zdiff, may_generate_now);
+			if (!s)
+				return false;
+			neighbors[1 + xdiff/SECTION_SIZE][1 + zdiff/SECTION_SIZE] = s;
+		}
+	}
+	return true;
+}
+
+// Doesn't touch the map, so that worker threads can run this
+static void prepare_section(Section& section, const Neighbors& neighbors)
+{
 	for (int xidx = 0; xidx <= SECTION_SIZE; xidx++) {
 		for (int zidx = 0; zidx <= SECTION_SIZE; zidx++) {
 			float y = 0;
 			for (int xdiff = -SECTION_SIZE; xdiff <= SECTION_SIZE; xdiff += SECTION_SIZE) {
 				for (int zdiff = -SECTION_SIZE; zdiff <= SECTION_SIZE; zdiff += SECTION_SIZE) {
-					Section *s = find_or_add_section(map, startx + xdiff, startz + zdiff);
+					const Section *s = neighbors[1 + xdiff/SECTION_SIZE][1 + zdiff/SECTION_SIZE];
 					int ix = xidx + SECTION_SIZE - xdiff;
 					int iz = zidx + SECTION_SIZE - zdiff;
 					y += s->raw_y_table[ix][iz];
 				}
 			}
-			section->y_table[xidx][zidx] = y;
+			section.y_table[xidx][zidx] = y;
 		}
 	}
 
-	int i = 0;
-	for (int ix = 0; ix < SECTION_SIZE; ix++) {
-		for (int iz = 0; iz < SECTION_SIZE; iz++) {
-			float sx = startx, sz = startz;  // c++ sucks ass
-			section->vertexdata[i++] = std::array<vec3, 3>{
-				vec3{sx + ix  , section->y_table[ix  ][iz  ], sz + iz  },
-				vec3{sx + ix+1, section->y_table[ix+1][iz  ], sz + iz  },
-				vec3{sx + ix  , section->y_table[ix  ][iz+1], sz + iz+1},
-			};
-			section->vertexdata[i++] = std::array<vec3, 3>{
-				vec3{sx + ix+1, section->y_table[ix+1][iz+1], sz + iz+1},
-				vec3{sx + ix+1, section->y_table[ix+1][iz  ], sz + iz  },
-				vec3{sx + ix  , section->y_table[ix  ][iz+1], sz + iz+1},
-			};
-		}
-	}
-	SDL_assert(i == section->vertexdata.size());
+	compute_gpu_heights(section);
+	section.state = PREPARED;
+}
 
-	section->y_table_and_vertexdata_ready = true;
+/*
+Writing a file is slow, and nothing needs to wait for it, so it's done in a low
+priority job after the section is PREPARED. A prepared section doesn't change,
+so it can be read while the main thread uses it.
+*/
+static void queue_saving_to_cache(ThreadPool& pool, std::atomic<int>& saves_pending, const Section& section, uint32_t world_seed, int startx, int startz)
+{
+	section.jobs_using++;  // don't evict while saving
+	saves_pending++;
+
+	std::atomic<int> *pending = &saves_pending;
+	const Section *sectionptr = &section;
+	std::function<void()> job = [sectionptr, pending, world_seed, startx, startz]() {
+		save_section_to_cache(*sectionptr, world_seed, startx, startz);
+		sectionptr->jobs_using--;
+		(*pending)--;
+	};
+	if (!pool.submit(job, JobPriority::Low))
+		job();
+}
+
+static Section *ensure_y_table_is_ready(MapPrivate& map, int startx, int startz)
+{
+	Section *section = find_or_add_section(map, startx, startz);
+	if (section->state == PREPARED)
+		return section;
+
+	PROFILE_SCOPE("ensure_y_table_is_ready");
+	Neighbors neighbors;
+	find_neighbors(map, startx, startz, neighbors);
+
+	int state = section->state;
+	if ((state == NOT_PREPARED || state == QUEUED_FOR_PREPARING) && section->state.compare_exchange_strong(state, PREPARING)) {
+		map.sync_preparations++;
+		prepare_section(*section, neighbors);
+		queue_saving_to_cache(*map.pool, map.cache_saves_pending, *section, map.seed, startx, startz);
+	} else {
+		// A worker thread is preparing it right now, should be done soon
+		map.pool->wait_until([section]() { return section->state == PREPARED; });
+	}
+	return section;
 }
 
+static bool circle_intersects_section(vec2 center, float r, int section_start_x, int section_start_z);
+
 // round down to multiple of SECTION_SIZE
 static int get_section_start_coordinate(float val)
 {
 	return (int)std::floor(val / SECTION_SIZE) * SECTION_SIZE;
 }
 
-float Map::get_height(float x, float z)
+/*
+Map is bilinear (weighted average of 4 corners) between points of y_table. Its
+derivatives can be calculated from the same 4 corners, so the normal vector
+doesn't need more height lookups. Section must be prepared.
+*/
+static void interpolate_height_and_normal(const Section& section, int startx, int startz, float x, float z, float& height, vec3& normal)
 {
-	int startx = get_section_start_coordinate(x), startz = get_section_start_coordinate(z);
-	Section *section = find_or_add_section(*this->priv, startx, startz);
-	ensure_y_table_is_ready(*this->priv, startx, startz);
-
 	float ixfloat = x - startx;
 	float izfloat = z - startz;
-	int ix = (int)std::floor(ixfloat);
-	int iz = (int)std::floor(izfloat);
-	// TODO: some kind of modulo function?
+	// x slightly less than a multiple of SECTION_SIZE can round to ixfloat == SECTION_SIZE
+	int ix = std::min((int)std::floor(ixfloat), SECTION_SIZE - 1);
+	int iz = std::min((int)std::floor(izfloat), SECTION_SIZE - 1);
 	float t = ixfloat - ix;
 	float u = izfloat - iz;
 
+	float y00 = section.y_table[ix][iz];
+	float y01 = section.y_table[ix][iz+1];
+	float y10 = section.y_table[ix+1][iz];
+	float y11 = section.y_table[ix+1][iz+1];
+
 	// weighted average, weight describes how close to a given corner
-	return (1-t)*(1-u)*section->y_table[ix][iz]
-		+ (1-t)*u*section->y_table[ix][iz+1]
-		+ t*(1-u)*section->y_table[ix+1][iz]
-		+ t*u*section->y_table[ix+1][iz+1];
+	height = (1-t)*(1-u)*y00 + (1-t)*u*y01 + t*(1-u)*y10 + t*u*y11;
+
+	float dydx = (1-u)*(y10 - y00) + u*(y11 - y01);
+	float dydz = (1-t)*(y01 - y00) + t*(y11 - y10);
+	normal = vec3{ -dydx, 1, -dydz };
 }
 
-vec3 Map::get_normal_vector(float x, float z)
+float Map::get_height(float x, float z)
 {
-	float h = 0.5f;  // Bigger value --> smoother but less accurate result
-	vec3 v = { 2*h, this->get_height(x+h,z) - this->get_height(x-h,z), 0 };
-	vec3 w = { 0, this->get_height(x,z+h) - this->get_height(x,z-h), 2*h };
-	return w.cross(v);
+	float height;
+	vec3 normal;
+	this->get_heights_and_normals(1, &x, &z, &height, &normal);
+	return height;
 }
 
-void Map::render(const Camera& cam)
+vec3 Map::get_normal_vector(float x, float z)
 {
-	glUseProgram(this->priv->shaderprogram);
-	glUniform3f(
-		glGetUniformLocation(this->priv->shaderprogram, "cameraLocation"),
-		cam.location.x, cam.location.y, cam.location.z);
-	glUniformMatrix3fv(
-		glGetUniformLocation(this->priv->shaderprogram, "world2cam"),
-		1, true, &cam.world2cam.rows[0][0]);
-
-	int startxmin = get_section_start_coordinate(cam.location.x - VIEW_RADIUS);
-	int startxmax = get_section_start_coordinate(cam.location.x + VIEW_RADIUS);
-	int startzmin = get_section_start_coordinate(cam.location.z - VIEW_RADIUS);
-	int startzmax = get_section_start_coordinate(cam.location.z + VIEW_RADIUS);
-
-	// +1 because both ends inlusive
-	int nx = (startxmax - startxmin)/SECTION_SIZE + 1;
-	int nz = (startzmax - startzmin)/SECTION_SIZE + 1;
-	int nsections = nx*nz;
-
-	int maxsections = ((2*VIEW_RADIUS)/SECTION_SIZE + 2)*((2*VIEW_RADIUS)/SECTION_SIZE + 2);
-	SDL_assert(nsections <= maxsections);
+	float height;
+	vec3 normal;
+	this->get_heights_and_normals(1, &x, &z, &height, &normal);
+	return normal;
+}
 
-	if (this->priv->vbo == 0) {
-		glGenBuffers(1, &this->priv->vbo);
-		SDL_assert(this->priv->vbo != 0);
-		glBindBuffer(GL_ARRAY_BUFFER, this->priv->vbo);
-		glBufferData(GL_ARRAY_BUFFER, maxsections*sizeof(((Section*)nullptr)->vertexdata), nullptr, GL_DYNAMIC_DRAW);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
+/*
+Consecutive points in the same section are done with one section lookup.
+Points are usually locations of enemies of one section, so there aren't many lookups.
+*/
+void Map::get_heights_and_normals(int n, const float *x, const float *z, float *heights, vec3 *normals)
+{
+	const Section *section = nullptr;
+	int startx = 0, startz = 0;
+
+	for (int i = 0; i < n; i++) {
+		int sx = get_section_start_coordinate(x[i]), sz = get_section_start_coordinate(z[i]);
+		if (!section || sx != startx || sz != startz) {
+			startx = sx;
+			startz = sz;
+			section = ensure_y_table_is_ready(*this->priv, startx, startz);
+		}
+		interpolate_height_and_normal(*section, startx, startz, x[i], z[i], heights[i], normals[i]);
 	}
+}
 
-	glBindBuffer(GL_ARRAY_BUFFER, this->priv->vbo);
-	int i = 0;
-	for (int startx = startxmin; startx <= startxmax; startx += SECTION_SIZE) {
-		for (int startz = startzmin; startz <= startzmax; startz += SECTION_SIZE) {
-			// TODO: don't send all vertexdata to gpu, if same section still visible as last time?
-			Section *section = find_or_add_section(*this->priv, startx, startz);
-			ensure_y_table_is_ready(*this->priv, startx, startz);
-			glBufferSubData(GL_ARRAY_BUFFER, i++*sizeof(section->vertexdata), sizeof(section->vertexdata), section->vertexdata.data());
+/*
+Same as Map::get_heights_and_normals(), but doesn't add or prepare sections.
+Worker threads can use this while the main thread isn't changing the map.
+Returns false if some of the sections aren't prepared yet.
+*/
+static bool get_heights_and_normals_if_ready(const MapPrivate& map, int n, const float *x, const float *z, float *heights, vec3 *normals)
+{
+	const Section *section = nullptr;
+	int startx = 0, startz = 0;
+
+	for (int i = 0; i < n; i++) {
+		int sx = get_section_start_coordinate(x[i]), sz = get_section_start_coordinate(z[i]);
+		if (!section || sx != startx || sz != startz) {
+			startx = sx;
+			startz = sz;
+			const std::unique_ptr<Section> *found = map.sections.find(std::make_pair(startx, startz));
+			if (!found || (*found)->state != PREPARED)
+				return false;
+			section = found->get();
 		}
+		interpolate_height_and_normal(*section, startx, startz, x[i], z[i], heights[i], normals[i]);
 	}
-	SDL_assert(i == nsections);
+	return true;
+}
 
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-	glDrawArrays(GL_TRIANGLES, 0, nsections*TRIANGLES_PER_SECTION*3);
+/*
+Level of detail: far away sections are drawn with fewer triangles, using only
+every 2nd, 4th or 8th vertex. On level n, every (1 << n)'th vertex is used.
+*/
+static constexpr int LOD_LEVELS = 4;
+static_assert(SECTION_SIZE % (1 << (LOD_LEVELS - 1)) == 0);
 
-	glDisableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glUseProgram(0);
+static int get_lod_level(vec3 camera_location, int startx, int startz)
+{
+	// distance from camera to nearest point of section, on xz plane
+	float dx = std::max({ startx - camera_location.x, 0.0f, camera_location.x - (startx + SECTION_SIZE) });
+	float dz = std::max({ startz - camera_location.z, 0.0f, camera_location.z - (startz + SECTION_SIZE) });
+	int level = (int)(std::hypot(dx, dz) / TERRAIN_LOD_DISTANCE);
+	return std::min(level, LOD_LEVELS - 1);
 }
 
-Map::Map()
+// Rounds to nearest multiple of step, or down if there are two nearest multiples
+static int round_to_multiple(int value, int step)
 {
-	this->priv = std::make_unique<MapPrivate>();
-	this->priv->queue.lock = SDL_CreateMutex();
-	SDL_assert(this->priv->queue.lock);
+	int remainder = value % step;
+	return (2*remainder <= step) ? value - remainder : value - remainder + step;
+}
 
-	this->priv->prepthread = SDL_CreateThread(section_preparing_thread, "NameOfTheMapSectionGeneratorThread", &this->priv->queue);
-	SDL_assert(this->priv->prepthread);
+/*
+Where a section meets a section with less detail, there would be gaps between them,
+because the more detailed section has vertices that the other section skips. To
+avoid that, those vertices are moved to the nearest vertex that both sections use.
+Some triangles then become degenerate (skipped), and others stretch to fill the space.
+
+side_levels contains levels of neighbors (or this section, if it's less detailed) on
+the sides where x is smallest, x is biggest, z is smallest and z is biggest.
+*/
+static std::vector<GLushort> create_lod_indexes(int level, const std::array<int, 4>& side_levels)
+{
+	auto vertex = [&side_levels](int ix, int iz) {
+		if (ix == 0) iz = round_to_multiple(iz, 1 << side_levels[0]);
+		else if (ix == SECTION_SIZE) iz = round_to_multiple(iz, 1 << side_levels[1]);
+		if (iz == 0) ix = round_to_multiple(ix, 1 << side_levels[2]);
+		else if (iz == SECTION_SIZE) ix = round_to_multiple(ix, 1 << side_levels[3]);
+		return (GLushort)(ix*(SECTION_SIZE + 1) + iz);
+	};
 
-	const char *vertex_shader =
+	std::vector<GLushort> result = {};
+	int step = 1 << level;
+	for (int ix = 0; ix < SECTION_SIZE; ix += step) {
+		for (int iz = 0; iz < SECTION_SIZE; iz += step) {
+			std::array<GLushort, 3> triangles[] = {
+				{ vertex(ix, iz), vertex(ix+step, iz), vertex(ix, iz+step) },
+				{ vertex(ix+step, iz+step), vertex(ix+step, iz), vertex(ix, iz+step) },
+			};
+			for (const std::array<GLushort, 3>& t : triangles) {
+				if (t[0] != t[1] && t[1] != t[2] && t[0] != t[2])
+					result.insert(result.end(), t.begin(), t.end());
+			}
+		}
+	}
+	return result;
+}
+
+static const LodIndexBuffer& get_lod_index_buffer(MapPrivate& map, int level, const std::array<int, 4>& side_levels)
+{
+	int key = level;
+	for (int side_level : side_levels)
+		key = key*LOD_LEVELS + side_level;
+
+	auto found = map.lod_index_buffers.find(key);
+	if (found != map.lod_index_buffers.end())
+		return found->second;
+
+	std::vector<GLushort> indexes = create_lod_indexes(level, side_levels);
+	LodIndexBuffer result = { 0, (int)indexes.size() };
+	gl_counted(glGenBuffers(1, &result.ibo));
+	SDL_assert(result.ibo != 0);
+	GlState::bind_element_array_buffer(result.ibo);
+	gl_counted(glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexes.size()*sizeof(indexes[0]), indexes.data(), GL_STATIC_DRAW));
+	return map.lod_index_buffers[key] = result;
+}
+
+static GLuint create_shader_program()
+{
+	std::string vertex_shader =
 		"#version 330\n"
 		"\n"
-		"layout(location = 0) in vec3 position;\n"
+		"layout(location = 0) in float height;\n"
 		"uniform vec3 cameraLocation;\n"
 		"uniform mat3 world2cam;\n"
+		"uniform vec2 sectionStart;\n"
 		"smooth out vec4 vertexToFragmentColor;\n"
 		"\n"
 		"BOILERPLATE_GOES_HERE\n"
 		"\n"
 		"void main(void)\n"
 		"{\n"
+		"    // gl_VertexID includes the base vertex, i.e. where the section is in the vbo\n"
+		"    int i = gl_VertexID % " + std::to_string(VERTICES_PER_SECTION) + ";\n"
+		"    vec3 position = vec3(\n"
+		"        sectionStart.x + float(i / " + std::to_string(SECTION_SIZE + 1) + "),\n"
+		"        height / " + std::to_string(HEIGHT_STEPS_PER_UNIT) + ".0,\n"
+		"        sectionStart.y + float(i % " + std::to_string(SECTION_SIZE + 1) + "));\n"
+		"\n"
 		"    vec3 pos = world2cam*(position - cameraLocation);\n"
 		"    gl_Position = locationFromCameraToGlPosition(pos);\n"
 		"\n"
@@ -364,30 +741,282 @@ Map::Map()
 		"    vertexToFragmentColor = darkerAtDistance(rgb, pos);\n"
 		"}\n"
 		;
-	this->priv->shaderprogram = OpenglBoilerplate::create_shader_program(vertex_shader);
+	return OpenglBoilerplate::create_shader_program(vertex_shader);
+}
+
+void Map::render(const Camera& cam)
+{
+	PROFILE_SCOPE("Map::render");
+	// Created here and not in constructor, so that you can use a map without opengl
+	MapPrivate& map = *this->priv;
+	if (map.shaderprogram == 0) {
+		map.shaderprogram = create_shader_program();
+		map.camera_location_uniform = GlState::get_uniform_location(map.shaderprogram, "cameraLocation");
+		map.world2cam_uniform = GlState::get_uniform_location(map.shaderprogram, "world2cam");
+		map.section_start_uniform = GlState::get_uniform_location(map.shaderprogram, "sectionStart");
+	}
+
+	GlState::use_program(map.shaderprogram);
+	gl_counted(glUniform3f(map.camera_location_uniform, cam.location.x, cam.location.y, cam.location.z));
+	gl_counted(glUniformMatrix3fv(map.world2cam_uniform, 1, true, &cam.world2cam.rows[0][0]));
+
+	int startxmin = get_section_start_coordinate(cam.location.x - VIEW_RADIUS);
+	int startxmax = get_section_start_coordinate(cam.location.x + VIEW_RADIUS);
+	int startzmin = get_section_start_coordinate(cam.location.z - VIEW_RADIUS);
+	int startzmax = get_section_start_coordinate(cam.location.z + VIEW_RADIUS);
+
+	// +1 because both ends inlusive
+	int nx = (startxmax - startxmin)/SECTION_SIZE + 1;
+	int nz = (startzmax - startzmin)/SECTION_SIZE + 1;
+	int nsections = nx*nz;
+
+	int maxsections = ((2*VIEW_RADIUS)/SECTION_SIZE + 2)*((2*VIEW_RADIUS)/SECTION_SIZE + 2);
+	SDL_assert(nsections <= maxsections);
+
+	if (map.vbo == 0) {
+		map.gpu_slots = std::vector<GpuSlot>(2*maxsections, GpuSlot{ {0,0}, -1 });
+		gl_counted(glGenBuffers(1, &map.vbo));
+		SDL_assert(map.vbo != 0);
+		GlState::bind_array_buffer(map.vbo);
+		gl_counted(glBufferData(GL_ARRAY_BUFFER, map.gpu_slots.size()*sizeof(((Section*)nullptr)->gpu_heights), nullptr, GL_DYNAMIC_DRAW));
+	}
+
+	map.frame++;
+	evict_sections_if_needed(map);
+	map.upload_bytes_last_frame = 0;
+	map.triangles_last_frame = 0;
+	map.sections_drawn_last_frame = 0;
+	map.sections_culled_last_frame = 0;
+	Frustum frustum(cam);
+
+	GlState::enable_attributes(0b1);
+	GlState::bind_array_buffer(map.vbo);
+	gl_counted(glVertexAttribPointer(0, 1, (sizeof(GpuHeight) == 2) ? GL_SHORT : GL_FLOAT, GL_FALSE, 0, 0));
+
+	for (int startx = startxmin; startx <= startxmax; startx += SECTION_SIZE) {
+		for (int startz = startzmin; startz <= startzmax; startz += SECTION_SIZE) {
+			// Heights are needed to know whether the section is visible
+			Section *section = ensure_y_table_is_ready(map, startx, startz);
+			vec3 box_min = { (float)startx, section->min_height, (float)startz };
+			vec3 box_max = { (float)(startx + SECTION_SIZE), section->max_height, (float)(startz + SECTION_SIZE) };
+			if (!frustum.box_is_visible(box_min, box_max)) {
+				map.sections_culled_last_frame++;
+				continue;
+			}
+
+			std::pair<int, int> key = { startx, startz };
+			auto slot = std::find_if(map.gpu_slots.begin(), map.gpu_slots.end(),
+				[&key](const GpuSlot& s) { return s.last_used_frame != -1 && s.key == key; });
+
+			if (slot == map.gpu_slots.end()) {
+				// Replace the slot that was used longest ago. It can't be used in this frame.
+				slot = std::min_element(map.gpu_slots.begin(), map.gpu_slots.end(),
+					[](const GpuSlot& a, const GpuSlot& b) { return a.last_used_frame < b.last_used_frame; });
+				SDL_assert(slot->last_used_frame != map.frame);
+
+				int offset = (slot - map.gpu_slots.begin())*sizeof(section->gpu_heights);
+				gl_counted(glBufferSubData(GL_ARRAY_BUFFER, offset, sizeof(section->gpu_heights), section->gpu_heights.data()));
+				slot->key = key;
+				map.upload_bytes_last_frame += sizeof(section->gpu_heights);
+			}
+
+			slot->last_used_frame = map.frame;
+
+			int level = get_lod_level(cam.location, startx, startz);
+			std::array<int, 4> side_levels = {
+				std::max(level, get_lod_level(cam.location, startx - SECTION_SIZE, startz)),
+				std::max(level, get_lod_level(cam.location, startx + SECTION_SIZE, startz)),
+				std::max(level, get_lod_level(cam.location, startx, startz - SECTION_SIZE)),
+				std::max(level, get_lod_level(cam.location, startx, startz + SECTION_SIZE)),
+			};
+			const LodIndexBuffer& indexes = get_lod_index_buffer(map, level, side_levels);
+
+			GlState::bind_element_array_buffer(indexes.ibo);
+			gl_counted(glUniform2f(map.section_start_uniform, startx, startz));
+			gl_counted(glDrawElementsBaseVertex(
+				GL_TRIANGLES, indexes.count, GL_UNSIGNED_SHORT, nullptr,
+				(slot - map.gpu_slots.begin())*VERTICES_PER_SECTION));
+			map.triangles_last_frame += indexes.count/3;
+			map.sections_drawn_last_frame++;
+		}
+	}
+	SDL_assert(map.sections_drawn_last_frame + map.sections_culled_last_frame == nsections);
+	map.upload_bytes_total += map.upload_bytes_last_frame;
+}
+
+void Map::prefetch(vec3 camera_location, vec3 velocity, vec3 heading, float seconds_ahead)
+{
+	MapPrivate& map = *this->priv;
+
+	// Usually the player keeps going, or turns to where the camera is looking
+	vec2 location = { camera_location.x, camera_location.z };
+	vec2 move = vec2{ velocity.x, velocity.z } * seconds_ahead;
+	vec2 turned_move = vec2{ heading.x, heading.z };
+	if (turned_move.length_squared() > 1e-6f)
+		turned_move = turned_move.with_length(move.length());
+
+	// Check every half section along the way, nearest first
+	int nsamples = std::min(8, (int)(move.length() / (SECTION_SIZE/2)) + 1);
+	std::vector<std::pair<int, int>> keys = {};
+	for (int i = 0; i <= nsamples; i++) {
+		for (vec2 p : { location + move*((float)i/nsamples), location + turned_move*((float)i/nsamples) }) {
+			for (int startx = get_section_start_coordinate(p.x - VIEW_RADIUS); startx <= p.x + VIEW_RADIUS; startx += SECTION_SIZE) {
+				for (int startz = get_section_start_coordinate(p.y - VIEW_RADIUS); startz <= p.y + VIEW_RADIUS; startz += SECTION_SIZE) {
+					if (std::find(keys.begin(), keys.end(), std::make_pair(startx, startz)) == keys.end())
+						keys.push_back(std::make_pair(startx, startz));
+				}
+			}
+		}
+	}
+
+	int max_jobs = 8;  // per frame, so that prefetching itself doesn't cause lag
+	for (std::pair<int, int> key : keys) {
+		// Don't generate sections now, that's what we're trying to avoid.
+		// Missing sections get queued for generating, and next frame we try again.
+		Section *section = find_or_add_section(map, key.first, key.second, false);
+		if (!section || section->state != NOT_PREPARED)
+			continue;
+
+		Neighbors neighbors;
+		if (!find_neighbors(map, key.first, key.second, neighbors, false))
+			continue;
+
+		section->state = QUEUED_FOR_PREPARING;
+		for (const auto& row : neighbors)
+			for (const Section *s : row)
+				s->jobs_using++;
+
+		uint32_t seed = map.seed;
+		ThreadPool *pool = map.pool.get();
+		std::atomic<int> *saves_pending = &map.cache_saves_pending;
+		bool ok = map.pool->submit([section, neighbors, seed, key, pool, saves_pending]() {
+			int state = QUEUED_FOR_PREPARING;
+			if (section->state.compare_exchange_strong(state, PREPARING)) {
+				prepare_section(*section, neighbors);
+				queue_saving_to_cache(*pool, *saves_pending, *section, seed, key.first, key.second);
+			}
+			for (const auto& row : neighbors)
+				for (const Section *s : row)
+					s->jobs_using--;
+		});
+		if (!ok) {
+			section->state = NOT_PREPARED;
+			for (const auto& row : neighbors)
+				for (const Section *s : row)
+					s->jobs_using--;
+			return;
+		}
+
+		map.prefetched++;
+		if (--max_jobs == 0)
+			return;
+	}
+}
+
+void Map::prebake(float radius)
+{
+	int startmin = get_section_start_coordinate(-radius);
+	int startmax = get_section_start_coordinate(radius);
+	int total = 0, done = 0;
+	for (int startx = startmin; startx <= startmax; startx += SECTION_SIZE)
+		for (int startz = startmin; startz <= startmax; startz += SECTION_SIZE)
+			total += circle_intersects_section(vec2{0,0}, radius, startx, startz);
+
+	for (int startx = startmin; startx <= startmax; startx += SECTION_SIZE) {
+		for (int startz = startmin; startz <= startmax; startz += SECTION_SIZE) {
+			if (!circle_intersects_section(vec2{0,0}, radius, startx, startz))
+				continue;
+			ensure_y_table_is_ready(*this->priv, startx, startz);  // queues saving to cache
+			this->priv->frame++;  // lets evict_sections_if_needed() delete old sections
+			evict_sections_if_needed(*this->priv);
+			if (++done % 100 == 0)
+				log_printf("Prebaked %d/%d sections", done, total);
+		}
+	}
+	this->priv->pool->wait(this->priv->cache_saves_pending);
+	log_printf("Prebaked %d sections, %d of them were already cached", total, (int)this->priv->loaded_from_cache);
+}
+
+Map::Map(uint32_t seed)
+{
+	this->priv = std::make_unique<MapPrivate>();
+	this->priv->seed = seed;
+	log_printf("World seed is %u", (unsigned)seed);
+	this->priv->pool = std::make_unique<ThreadPool>(WORKER_THREADS);
 }
 
 Map::~Map()
 {
 	// TODO: delete some of the opengl stuff?
-	this->priv->queue.quit = true;
-	SDL_WaitThread(this->priv->prepthread, nullptr);
-	SDL_DestroyMutex(this->priv->queue.lock);
+	this->priv->pool.reset();  // stop threads that could be using sections
 }
 
 
-void Map::add_enemy(const Enemy& enemy) {
+// Enemy must already have a slot
+static void add_enemy_to_section(MapPrivate& map, const Enemy& enemy)
+{
 	int startx = get_section_start_coordinate(enemy.entity.location.x);
 	int startz = get_section_start_coordinate(enemy.entity.location.z);
-	Section *section = find_or_add_section(*this->priv, startx, startz);
+	Section *section = find_or_add_section(map, startx, startz);
+
+	EnemySlot& slot = map.enemy_slots[enemy.handle.slot];
+	slot.section = std::make_pair(startx, startz);
+	slot.index = section->enemies.size();
 	section->enemies.push_back(enemy);
 }
 
+// Doesn't free the slot, because the enemy may be added to another section
+static void remove_enemy_from_section(MapPrivate& map, EnemyArrays& enemies, int i)
+{
+	enemies.remove(i);
+	if (i < enemies.size())
+		map.enemy_slots[enemies.handle[i].slot].index = i;  // last enemy moved here
+}
+
+EnemyHandle Map::add_enemy(const Enemy& enemy) {
+	MapPrivate& map = *this->priv;
+
+	Enemy copy = enemy;
+	if (map.free_enemy_slots.empty()) {
+		copy.handle = EnemyHandle{ (int)map.enemy_slots.size(), 0 };
+		map.enemy_slots.push_back(EnemySlot{ {0, 0}, -1, 0 });
+	} else {
+		int slot = map.free_enemy_slots.back();
+		map.free_enemy_slots.pop_back();
+		copy.handle = EnemyHandle{ slot, map.enemy_slots[slot].generation };
+	}
+
+	add_enemy_to_section(map, copy);
+	return copy.handle;
+}
+
+MapStats Map::get_stats() const
+{
+	MapStats stats = {};
+	stats.sections = this->priv->sections.size();
+	stats.sync_generations = this->priv->sync_generations;
+	stats.prefetched = this->priv->prefetched;
+	stats.frames_rendered = this->priv->frame;
+	stats.upload_bytes_last_frame = this->priv->upload_bytes_last_frame;
+	stats.upload_bytes_total = this->priv->upload_bytes_total;
+	stats.triangles_last_frame = this->priv->triangles_last_frame;
+	stats.sections_drawn_last_frame = this->priv->sections_drawn_last_frame;
+	stats.sections_culled_last_frame = this->priv->sections_culled_last_frame;
+	stats.sync_preparations = this->priv->sync_preparations;
+	stats.worker_threads = this->priv->pool->get_number_of_threads();
+	stats.job_queue_length = this->priv->pool->get_queue_length(JobPriority::Low) + this->priv->pool->get_queue_length(JobPriority::High);
+	stats.section_jobs_pending = this->priv->generation_jobs_pending;
+	stats.sections_evicted = this->priv->sections_evicted;
+	stats.sections_from_cache = this->priv->loaded_from_cache;
+	this->priv->sections.for_each([&](std::pair<int, int>, const std::unique_ptr<Section>& section) {
+		stats.memory_bytes += get_memory_usage(*section);
+	});
+
+	return stats;
+}
+
 int Map::get_number_of_enemies() const {
-	int result = 0;
-	for (const auto& item : this->priv->sections)
-		result += item.second->enemies.size();
-	return result;
+	return this->priv->enemy_slots.size() - this->priv->free_enemy_slots.size();
 }
 
 
@@ -437,8 +1066,10 @@ struct LocationAndSection {
 	Section* section;
 };
 
-static std::vector<LocationAndSection> find_sections_within_circle(const MapPrivate& map, float center_x, float center_z, float radius) {
-	std::vector<LocationAndSection> result = {};
+// Calls f(LocationAndSection) for sections that exist
+template<typename F>
+static void for_each_section_within_circle(const MapPrivate& map, float center_x, float center_z, float radius, F f)
+{
 	int startx_min = get_section_start_coordinate(center_x - radius);
 	int startx_max = get_section_start_coordinate(center_x + radius);
 	int startz_min = get_section_start_coordinate(center_z - radius);
@@ -447,92 +1078,211 @@ static std::vector<LocationAndSection> find_sections_within_circle(const MapPriv
 	for (int startx = startx_min; startx <= startx_max; startx += SECTION_SIZE) {
 		for (int startz = startz_min; startz <= startz_max; startz += SECTION_SIZE) {
 			if (circle_intersects_section(vec2{center_x,center_z}, radius, startx, startz)) {
-				auto find_result = map.sections.find(std::make_pair(startx, startz));
-				if (find_result != map.sections.end())
-					result.push_back({ startx, startz, find_result->second.get() });
+				const std::unique_ptr<Section> *found = map.sections.find(std::make_pair(startx, startz));
+				if (found)
+					f(LocationAndSection{ startx, startz, found->get() });
 			}
 		}
 	}
-	return result;
 }
 
-std::vector<const Enemy*> Map::find_enemies_within_circle(float center_x, float center_z, float radius) const
+// Clamps so that enemies slightly outside the section still go to a cell
+static int get_enemy_grid_coordinate(float val, int section_start)
 {
-	std::vector<const Enemy*> result = {};
-	for (LocationAndSection las : find_sections_within_circle(*this->priv, center_x, center_z, radius)) {
-		for (int i = 0; i < las.section->enemies.size(); i++) {
-			Enemy* enemy = &las.section->enemies.data()[i];
-			float dx = center_x - enemy->entity.location.x;
-			float dz = center_z - enemy->entity.location.z;
-			if (dx*dx + dz*dz < radius*radius)
-				result.push_back(&las.section->enemies.data()[i]);
-		}
+	return std::clamp((int)std::floor((val - section_start) / ENEMY_GRID_CELL_SIZE), 0, ENEMY_GRID_SIZE - 1);
+}
+
+static void update_enemy_grid(const Section& section, int startx, int startz)
+{
+	const EnemyArrays& enemies = section.enemies;
+	EnemyGrid& grid = section.enemy_grid;
+	if (grid.version == enemies.version)
+		return;
+
+	// Counting sort: count enemies in each cell, then put each cell after the previous one
+	std::array<int, ENEMY_GRID_SIZE*ENEMY_GRID_SIZE> next = {};
+	for (int i = 0; i < enemies.size(); i++)
+		next[get_enemy_grid_coordinate(enemies.x[i], startx)*ENEMY_GRID_SIZE + get_enemy_grid_coordinate(enemies.z[i], startz)]++;
+
+	int total = 0;
+	for (int c = 0; c < ENEMY_GRID_SIZE*ENEMY_GRID_SIZE; c++) {
+		grid.cell_begin[c] = total;
+		total += next[c];
+		next[c] = grid.cell_begin[c];
 	}
-	return result;
+	grid.cell_begin[ENEMY_GRID_SIZE*ENEMY_GRID_SIZE] = total;
+
+	grid.indexes.resize(enemies.size());
+	for (int i = 0; i < enemies.size(); i++)
+		grid.indexes[next[get_enemy_grid_coordinate(enemies.x[i], startx)*ENEMY_GRID_SIZE + get_enemy_grid_coordinate(enemies.z[i], startz)]++] = i;
+
+	grid.version = enemies.version;
 }
 
-std::vector<const Enemy*> Map::find_colliding_enemies(const Entity& collide_with)
+void Map::visit_enemies_within_circle(float center_x, float center_z, float radius, void (*callback)(void*, const Enemy&), void *data) const
 {
-	std::vector<const Enemy*> result = {};
+	for_each_section_within_circle(*this->priv, center_x, center_z, radius, [&](LocationAndSection las) {
+		const EnemyArrays& enemies = las.section->enemies;
+		if (enemies.size() == 0)
+			return;
+		update_enemy_grid(*las.section, las.startx, las.startz);
+		const EnemyGrid& grid = las.section->enemy_grid;
+
+		int cxmin = get_enemy_grid_coordinate(center_x - radius, las.startx);
+		int cxmax = get_enemy_grid_coordinate(center_x + radius, las.startx);
+		int czmin = get_enemy_grid_coordinate(center_z - radius, las.startz);
+		int czmax = get_enemy_grid_coordinate(center_z + radius, las.startz);
+
+		for (int cx = cxmin; cx <= cxmax; cx++) {
+			for (int cz = czmin; cz <= czmax; cz++) {
+				int c = cx*ENEMY_GRID_SIZE + cz;
+				for (int k = grid.cell_begin[c]; k < grid.cell_begin[c+1]; k++) {
+					int i = grid.indexes[k];
+					float dx = center_x - enemies.x[i];
+					float dz = center_z - enemies.z[i];
+					if (dx*dx + dz*dz < radius*radius)
+						callback(data, enemies.get(i));
+				}
+			}
+		}
+	});
+}
 
+void Map::visit_colliding_enemies(const Entity& collide_with, void (*callback)(void*, const Enemy&), void *data)
+{
 	// TODO: hard-coded 10 also appears in a few other places
-	for (const Enemy* enemy : this->find_enemies_within_circle(collide_with.location.x, collide_with.location.z, 10)) {
-		if (enemy->entity.collides_with(collide_with, *this))
-			result.push_back(enemy);
+	this->for_each_enemy_within_circle(collide_with.location.x, collide_with.location.z, 10, [&](const Enemy& enemy) {
+		if (enemy.entity.collides_with(collide_with, *this))
+			callback(data, enemy);
+	});
+}
+
+void Map::remove_enemies(const std::vector<EnemyHandle>& handles)
+{
+	MapPrivate& map = *this->priv;
+	if (handles.size() != 0)
+		log_debug("Removing %zu enemies", handles.size());
+
+	for (EnemyHandle handle : handles) {
+		EnemySlot& slot = map.enemy_slots[handle.slot];
+		if (slot.index == -1 || slot.generation != handle.generation)
+			continue;  // already removed
+
+		std::unique_ptr<Section> *section = map.sections.find(slot.section);
+		EnemyArrays *enemies = section ? &(*section)->enemies : map.evicted_enemies.find(slot.section);
+		SDL_assert(enemies);
+		remove_enemy_from_section(map, *enemies, slot.index);
+
+		slot.index = -1;
+		slot.generation++;
+		map.free_enemy_slots.push_back(handle.slot);
 	}
-	return result;
 }
 
-void Map::remove_enemies(const std::vector<const Enemy *> enemies)
+// Enemies of one section, moved by a worker thread or the main thread
+struct EnemyMoveJob {
+	LocationAndSection las;
+	std::vector<int> leaving;  // indexes of enemies that went to a different section, biggest first
+	bool done;  // false if part of the map wasn't ready, then main thread does it later
+};
+
+static constexpr int ENEMIES_PER_THREAD_JOB = 512;  // less than this isn't worth sending to another thread
+
+/*
+Only reads the map and changes enemies of the job's section, so that different
+sections can be done in different threads at the same time. Enemies going to
+other sections are left in place, because moving them changes enemy slots.
+*/
+static void move_enemies_of_section(const MapPrivate& map, EnemyMoveJob& job, vec3 player_location, float dt)
 {
-	if (enemies.size() != 0)
-		log_printf("Removing %zu enemies", enemies.size());
+	EnemyArrays& enemies = job.las.section->enemies;
+	std::vector<float> heights(enemies.size());
+	std::vector<vec3> normals(enemies.size());
 
-	std::unordered_map<Section*, std::vector<int>> indexes_to_delete_by_section;
-	for (const Enemy* e : enemies) {
-		Section* section = this->priv->sections[std::make_pair(get_section_start_coordinate(e->entity.location.x), get_section_start_coordinate(e->entity.location.z))].get();
-		indexes_to_delete_by_section[section].push_back(e - &section->enemies[0]);
+	// Check everything before changing anything, so that main thread can do it all again
+	if (!get_heights_and_normals_if_ready(map, enemies.size(), enemies.x.data(), enemies.z.data(), heights.data(), normals.data())) {
+		job.done = false;
+		return;
 	}
 
-	for (const auto& pair : indexes_to_delete_by_section) {
-		Section* section = pair.first;
-		std::vector<int> indexes = pair.second;
-		std::sort(indexes.begin(), indexes.end());
-		std::reverse(indexes.begin(), indexes.end());
+	enemies.move_towards_player(player_location, heights.data(), normals.data(), dt);
 
-		// pop_back() invalidates iterators and can apparently shrink the vector
-		int len = section->enemies.size();
-		for (int i : indexes)
-			section->enemies[i] = section->enemies[--len];
-		section->enemies.erase(section->enemies.begin() + len, section->enemies.end());
+	for (int i = enemies.size() - 1; i >= 0; i--) {
+		int startx = get_section_start_coordinate(enemies.x[i]);
+		int startz = get_section_start_coordinate(enemies.z[i]);
+		if (startx != job.las.startx || startz != job.las.startz)
+			job.leaving.push_back(i);
 	}
+	job.done = true;
 }
 
+/*
+Sections are moved in parallel, and enemies that go to a different section are
+added to it after all threads are done, in the same order as sections are
+found. So the result doesn't depend on how many threads there are.
+*/
 void Map::move_enemies(vec3 player_location, float dt)
 {
-	std::vector<Enemy> moved = {};
-
-	for (LocationAndSection las : find_sections_within_circle(*this->priv, player_location.x, player_location.z, 2*VIEW_RADIUS)) {
-		std::vector<Enemy>& enemies = las.section->enemies;
-
-		for (int i = enemies.size() - 1; i >= 0; i--) {
-			enemies[i].move_towards_player(player_location, *this, dt);
+	PROFILE_SCOPE("Map::move_enemies");
+	MapPrivate& map = *this->priv;
+	map.player_location = player_location;
+
+	std::vector<EnemyMoveJob> jobs = {};
+	for_each_section_within_circle(map, player_location.x, player_location.z, 2*VIEW_RADIUS, [&](LocationAndSection las) {
+		if (las.section->enemies.size() != 0)
+			jobs.push_back(EnemyMoveJob{ las, {}, false });
+	});
+	for (const EnemyMoveJob& job : jobs)
+		ensure_y_table_is_ready(map, job.las.startx, job.las.startz);
+
+	// Workers get consecutive sections with enough enemies to be worth it, main thread does the rest
+	std::atomic<int> jobs_running(0);
+	int first = 0, count = 0;
+	for (int i = 0; i < (int)jobs.size(); i++) {
+		count += jobs[i].las.section->enemies.size();
+		if (count < ENEMIES_PER_THREAD_JOB)
+			continue;
 
-			int startx = get_section_start_coordinate(enemies[i].entity.location.x);
-			int startz = get_section_start_coordinate(enemies[i].entity.location.z);
-			if (startx != las.startx || startz != las.startz) {
-				log_printf("Enemy moves to different section");
-				moved.push_back(enemies[i]);
-				enemies[i] = enemies[enemies.size()-1];
-				enemies.pop_back();
-			}
+		EnemyMoveJob *begin = &jobs[first], *end = &jobs[i] + 1;
+		jobs_running++;
+		bool ok = map.pool->submit([&map, begin, end, player_location, dt, &jobs_running]() {
+			for (EnemyMoveJob *job = begin; job != end; job++)
+				move_enemies_of_section(map, *job, player_location, dt);
+			jobs_running--;
+		}, JobPriority::High);
+		if (!ok) {
+			for (EnemyMoveJob *job = begin; job != end; job++)
+				move_enemies_of_section(map, *job, player_location, dt);
+			jobs_running--;
+		}
+		first = i+1;
+		count = 0;
+	}
+	for (int i = first; i < (int)jobs.size(); i++)
+		move_enemies_of_section(map, jobs[i], player_location, dt);
+	map.pool->wait(jobs_running);
+
+	for (EnemyMoveJob& job : jobs) {
+		if (!job.done) {
+			// Enemy is in a section that isn't prepared yet. Prepare it here, then it can't fail.
+			const EnemyArrays& enemies = job.las.section->enemies;
+			std::vector<float> heights(enemies.size());
+			std::vector<vec3> normals(enemies.size());
+			this->get_heights_and_normals(enemies.size(), enemies.x.data(), enemies.z.data(), heights.data(), normals.data());
+			move_enemies_of_section(map, job, player_location, dt);
+			SDL_assert(job.done);
 		}
 	}
 
+	std::vector<Enemy> moved = {};
+	for (const EnemyMoveJob& job : jobs) {
+		for (int i : job.leaving) {
+			moved.push_back(job.las.section->enemies.get(i));
+			remove_enemy_from_section(map, job.las.section->enemies, i);
+		}
+	}
 	for (const Enemy& e : moved) {
-		int startx = get_section_start_coordinate(e.entity.location.x);
-		int startz = get_section_start_coordinate(e.entity.location.z);
-		Section* section = find_or_add_section(*this->priv, startx, startz);
-		section->enemies.push_back(e);
+		log_debug("Enemy moves to different section");
+		add_enemy_to_section(map, e);
 	}
 }
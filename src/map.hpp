@@ -1,18 +1,41 @@
 #ifndef MAP_HPP
 #define MAP_HPP
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 #include "camera.hpp"
 #include "linalg.hpp"
 
 class Enemy;  // IWYU pragma: keep  // FIXME: project structure = shit
+struct EnemyHandle;  // IWYU pragma: keep
 class Entity;  // IWYU pragma: keep  // FIXME: project structure = shit
 struct MapPrivate;  // IWYU pragma: keep  // don't want to shit private stuff all over header file
 
+// Counters for seeing what's going on
+struct MapStats {
+	int sections;  // number of sections in memory
+	int sections_evicted;  // how many times a section was deleted to save memory
+	long long memory_bytes;  // used by sections
+	int sections_from_cache;  // read from terrain cache instead of generating
+	int section_jobs_pending;  // sections being generated or waiting for a worker thread
+	int job_queue_length;  // all jobs waiting for a worker thread
+	int worker_threads;
+	int sync_generations;  // how many times a section had to be generated while the game waits
+	int prefetched;  // how many sections were prepared in the background before they were needed
+	int sync_preparations;  // how many times a section had to be prepared while the game waits
+	int frames_rendered;
+	int upload_bytes_last_frame;  // how much terrain data was sent to the gpu
+	long long upload_bytes_total;
+	int triangles_last_frame;  // terrain triangles drawn
+	int sections_drawn_last_frame;
+	int sections_culled_last_frame;  // not drawn because camera doesn't see them
+};
+
 class Map {
 public:
-	Map();
+	// Same seed always gives the same terrain
+	Map(uint32_t seed);
 	~Map();
 	Map(const Map&) = delete;
 
@@ -20,20 +43,47 @@ public:
 
 	float get_height(float x, float z);
 	vec3 get_normal_vector(float x, float z);  // arbitrary length, points away from surface
+
+	// Same as the above for n points at once, faster than calling them n times
+	void get_heights_and_normals(int n, const float *x, const float *z, float *heights, vec3 *normals);
 	void render(const Camera& camera);
 
-	void add_enemy(const Enemy&);
+	// Prepares sections in the background, if camera will see them within the given time
+	void prefetch(vec3 camera_location, vec3 velocity, vec3 heading, float seconds_ahead);
+
+	// Generates all sections within radius of origin into the terrain cache
+	void prebake(float radius);
+
+	EnemyHandle add_enemy(const Enemy&);
 	void move_enemies(vec3 player_location, float dt);
 	int get_number_of_enemies() const;
+	MapStats get_stats() const;
+
+	/*
+	Calls f(const Enemy&) for each enemy within the circle, without allocating
+	memory. f gets a copy, because enemies are stored as separate arrays of
+	positions, speeds etc. Don't add or remove enemies in f.
+	*/
+	template<typename F>
+	void for_each_enemy_within_circle(float center_x, float center_z, float radius, F f) const
+	{
+		this->visit_enemies_within_circle(center_x, center_z, radius, [](void *fptr, const Enemy& e) { (*(F*)fptr)(e); }, &f);
+	}
 
-	// TODO: don't return a vector, some kind of iterator instead?
-	std::vector<const Enemy*> find_enemies_within_circle(float center_x, float center_z, float radius) const;
-	std::vector<const Enemy*> find_colliding_enemies(const Entity& collide_with);
+	// Calls f(const Enemy&) for each enemy that collides with the given entity, same rules as above
+	template<typename F>
+	void for_each_colliding_enemy(const Entity& collide_with, F f)
+	{
+		this->visit_colliding_enemies(collide_with, [](void *fptr, const Enemy& e) { (*(F*)fptr)(e); }, &f);
+	}
 
-	void remove_enemies(const std::vector<const Enemy *> enemies);
+	// Handles of enemies that are already removed are ignored
+	void remove_enemies(const std::vector<EnemyHandle>& handles);
 
 private:
 	std::unique_ptr<MapPrivate> priv;
+	void visit_enemies_within_circle(float center_x, float center_z, float radius, void (*callback)(void*, const Enemy&), void *data) const;
+	void visit_colliding_enemies(const Entity& collide_with, void (*callback)(void*, const Enemy&), void *data);
 };
 
 #endif
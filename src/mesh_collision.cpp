@@ -0,0 +1,224 @@
+#include "mesh_collision.hpp"
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+#include "linalg.hpp"
+
+static constexpr int MAX_TRIANGLES_PER_LEAF = 4;
+
+// Splitting in half makes trees at most about 30 levels deep, and the stack
+// holds at most 2 pairs per level of each tree
+static constexpr int MAX_STACK_SIZE = 128;
+
+static vec3 min3(vec3 a, vec3 b) { return vec3{ std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z) }; }
+static vec3 max3(vec3 a, vec3 b) { return vec3{ std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z) }; }
+
+static float component(vec3 v, int axis) { return axis == 0 ? v.x : (axis == 1 ? v.y : v.z); }
+
+TriangleBVH::TriangleBVH(const std::vector<std::array<vec3, 3>>& triangles) : triangles(triangles)
+{
+	if (!triangles.empty())
+		this->build(0, triangles.size());
+}
+
+// Returns index of the new node
+int TriangleBVH::build(int first, int count)
+{
+	int index = this->nodes.size();
+	this->nodes.push_back(Node{});
+
+	vec3 min = this->triangles[first][0], max = min;
+	vec3 centermin = min, centermax = min;
+	for (int i = first; i < first + count; i++) {
+		const std::array<vec3, 3>& t = this->triangles[i];
+		vec3 center = (t[0] + t[1] + t[2])/3;
+		centermin = min3(centermin, center);
+		centermax = max3(centermax, center);
+		for (vec3 v : t) {
+			min = min3(min, v);
+			max = max3(max, v);
+		}
+	}
+
+	Node node = { min, max, -1, -1, first, count };
+	if (count > MAX_TRIANGLES_PER_LEAF) {
+		// Split along the longest axis, half of triangles to each child
+		vec3 size = centermax - centermin;
+		int axis = (size.x > size.y && size.x > size.z) ? 0 : (size.y > size.z ? 1 : 2);
+		auto begin = this->triangles.begin() + first;
+		std::nth_element(begin, begin + count/2, begin + count,
+			[axis](const std::array<vec3, 3>& a, const std::array<vec3, 3>& b) {
+				return component(a[0] + a[1] + a[2], axis) < component(b[0] + b[1] + b[2], axis);
+			});
+		node.left = this->build(first, count/2);
+		node.right = this->build(first + count/2, count - count/2);
+	}
+
+	this->nodes[index] = node;  // not a reference, because build() resizes nodes
+	return index;
+}
+
+static bool boxes_are_close(vec3 min1, vec3 max1, vec3 min2, vec3 max2, float distance)
+{
+	return min1.x - distance <= max2.x && min2.x <= max1.x + distance
+		&& min1.y - distance <= max2.y && min2.y <= max1.y + distance
+		&& min1.z - distance <= max2.z && min2.z <= max1.z + distance;
+}
+
+bool TriangleBVH::is_within_distance(const TriangleBVH& other, const mat3& rotation, vec3 offset, float distance) const
+{
+	if (this->nodes.empty() || other.nodes.empty())
+		return false;
+
+	// Rotating a box gives a box that is not axis-aligned, so use a bigger box around that instead
+	mat3 abs_rotation = rotation;
+	for (std::array<float, 3>& row : abs_rotation.rows)
+		for (float& f : row)
+			f = std::abs(f);
+
+	// Called for every enemy on every frame, so no std::vector here
+	std::array<vec3, 3> other_triangles[MAX_TRIANGLES_PER_LEAF];  // moved to coordinates of this mesh
+	std::pair<int, int> stack[MAX_STACK_SIZE] = { {0, 0} };
+	int stacksize = 1;
+
+	while (stacksize > 0) {
+		stacksize--;
+		int aindex = stack[stacksize].first, bindex = stack[stacksize].second;
+		const Node& a = this->nodes[aindex];
+		const Node& b = other.nodes[bindex];
+
+		vec3 bcenter = rotation*((b.min + b.max)/2) + offset;
+		vec3 bhalf = abs_rotation*((b.max - b.min)/2);
+		if (!boxes_are_close(a.min, a.max, bcenter - bhalf, bcenter + bhalf, distance))
+			continue;
+
+		bool aleaf = (a.left == -1), bleaf = (b.left == -1);
+		if (aleaf && bleaf) {
+			SDL_assert(b.count <= MAX_TRIANGLES_PER_LEAF);
+			for (int j = 0; j < b.count; j++) {
+				const std::array<vec3, 3>& t = other.triangles[b.first + j];
+				other_triangles[j] = { rotation*t[0] + offset, rotation*t[1] + offset, rotation*t[2] + offset };
+			}
+			for (int i = a.first; i < a.first + a.count; i++)
+				for (int j = 0; j < b.count; j++)
+					if (triangle_distance(this->triangles[i], other_triangles[j]) < distance)
+						return true;
+		} else {
+			SDL_assert(stacksize + 2 <= MAX_STACK_SIZE);
+			if (bleaf || (!aleaf && a.count > b.count)) {
+				stack[stacksize++] = { a.left, bindex };
+				stack[stacksize++] = { a.right, bindex };
+			} else {
+				stack[stacksize++] = { aindex, b.left };
+				stack[stacksize++] = { aindex, b.right };
+			}
+		}
+	}
+	return false;
+}
+
+static vec3 closest_point_on_segment(vec3 p, vec3 a, vec3 b)
+{
+	vec3 ab = b - a;
+	float t = (p - a).dot(ab) / std::max(ab.length_squared(), 1e-12f);
+	return a + ab*std::clamp(t, 0.0f, 1.0f);
+}
+
+// From "Real-Time Collision Detection" by Christer Ericson, section 5.1.5
+static vec3 closest_point_on_triangle(vec3 p, const std::array<vec3, 3>& t)
+{
+	vec3 normal = (t[1] - t[0]).cross(t[2] - t[0]);
+	if (normal.length_squared() < 1e-12f)  // degenerate, e.g. at pole of a surface
+		return closest_point_on_segment(p, t[0], (t[1] - t[0]).length_squared() > (t[2] - t[0]).length_squared() ? t[1] : t[2]);
+
+	vec3 projected = p - (p - t[0]).projection_to(normal);
+	bool inside = true;
+	for (int i = 0; i < 3; i++) {
+		vec3 edge = t[(i+1)%3] - t[i];
+		if (edge.cross(projected - t[i]).dot(normal) < 0)
+			inside = false;
+	}
+	if (inside)
+		return projected;
+
+	vec3 best = closest_point_on_segment(p, t[0], t[1]);
+	for (int i = 1; i < 3; i++) {
+		vec3 candidate = closest_point_on_segment(p, t[i], t[(i+1)%3]);
+		if ((candidate - p).length_squared() < (best - p).length_squared())
+			best = candidate;
+	}
+	return best;
+}
+
+// From "Real-Time Collision Detection", section 5.1.9
+static float segment_distance_squared(vec3 p1, vec3 q1, vec3 p2, vec3 q2)
+{
+	vec3 d1 = q1 - p1, d2 = q2 - p2, r = p1 - p2;
+	float a = d1.dot(d1), e = d2.dot(d2), f = d2.dot(r);
+	float s, t;
+
+	if (a < 1e-12f && e < 1e-12f) {
+		s = t = 0;
+	} else if (a < 1e-12f) {
+		s = 0;
+		t = std::clamp(f/e, 0.0f, 1.0f);
+	} else {
+		float c = d1.dot(r);
+		if (e < 1e-12f) {
+			t = 0;
+			s = std::clamp(-c/a, 0.0f, 1.0f);
+		} else {
+			float b = d1.dot(d2);
+			float denom = a*e - b*b;
+			s = (denom > 1e-12f) ? std::clamp((b*f - c*e)/denom, 0.0f, 1.0f) : 0;
+			t = (b*s + f)/e;
+			if (t < 0) {
+				t = 0;
+				s = std::clamp(-c/a, 0.0f, 1.0f);
+			} else if (t > 1) {
+				t = 1;
+				s = std::clamp((b - c)/a, 0.0f, 1.0f);
+			}
+		}
+	}
+	return ((p1 + d1*s) - (p2 + d2*t)).length_squared();
+}
+
+static bool segment_intersects_triangle(vec3 p, vec3 q, const std::array<vec3, 3>& t)
+{
+	vec3 normal = (t[1] - t[0]).cross(t[2] - t[0]);
+	float dp = (p - t[0]).dot(normal);
+	float dq = (q - t[0]).dot(normal);
+	if ((dp > 0 && dq > 0) || (dp < 0 && dq < 0) || dp == dq)
+		return false;  // both ends on same side, or parallel (handled by edge-edge distances)
+
+	vec3 hit = p + (q - p)*(dp/(dp - dq));
+	for (int i = 0; i < 3; i++) {
+		if ((t[(i+1)%3] - t[i]).cross(hit - t[i]).dot(normal) < 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+If the triangles don't intersect, the shortest distance is between a corner of
+one triangle and the other triangle, or between two edges.
+*/
+float triangle_distance(const std::array<vec3, 3>& a, const std::array<vec3, 3>& b)
+{
+	for (int i = 0; i < 3; i++) {
+		if (segment_intersects_triangle(a[i], a[(i+1)%3], b) || segment_intersects_triangle(b[i], b[(i+1)%3], a))
+			return 0;
+	}
+
+	float best = HUGE_VALF;
+	for (int i = 0; i < 3; i++) {
+		best = std::min(best, (closest_point_on_triangle(a[i], b) - a[i]).length_squared());
+		best = std::min(best, (closest_point_on_triangle(b[i], a) - b[i]).length_squared());
+		for (int j = 0; j < 3; j++)
+			best = std::min(best, segment_distance_squared(a[i], a[(i+1)%3], b[j], b[(j+1)%3]));
+	}
+	return std::sqrt(best);
+}
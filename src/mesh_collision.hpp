@@ -0,0 +1,45 @@
+#ifndef MESH_COLLISION_HPP
+#define MESH_COLLISION_HPP
+
+#include <array>
+#include <vector>
+#include "linalg.hpp"
+
+/*
+Bounding volume hierarchy of triangles, for checking whether two meshes are
+close to each other. Each node has a box that contains all its triangles, and
+two meshes can't touch if boxes of their root nodes are far apart. If they are
+close, we look at children of the nodes, and so on, until we are comparing
+individual triangles.
+*/
+class TriangleBVH {
+public:
+	TriangleBVH() = default;
+	TriangleBVH(const std::vector<std::array<vec3, 3>>& triangles);
+
+	/*
+	Returns true if some point of this mesh is closer than distance to some
+	point of the other mesh. To get from coordinates of the other mesh to
+	coordinates of this mesh, multiply by rotation and then add offset.
+	*/
+	bool is_within_distance(const TriangleBVH& other, const mat3& rotation, vec3 offset, float distance) const;
+
+	int get_number_of_triangles() const { return this->triangles.size(); }
+
+private:
+	struct Node {
+		vec3 min, max;  // box containing all triangles of node
+		int left, right;  // indexes into nodes, or -1 for leaf node
+		int first, count;  // triangles of leaf node
+	};
+
+	int build(int first, int count);
+
+	std::vector<std::array<vec3, 3>> triangles;
+	std::vector<Node> nodes;  // nodes[0] is the root
+};
+
+// Shortest distance between any point of triangle a and any point of triangle b
+float triangle_distance(const std::array<vec3, 3>& a, const std::array<vec3, 3>& b);
+
+#endif
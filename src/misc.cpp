@@ -6,3 +6,28 @@ float uniform_random_float(float min, float max)
 	// I tried writing this in "modern C++" style but that was more complicated
 	return lerp(min, max, std::rand() / (float)RAND_MAX);
 }
+
+// splitmix64 finalizer, turns similar inputs into very different outputs
+static uint64_t mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+CounterRandom::CounterRandom(uint32_t seed, int32_t a, int32_t b)
+{
+	this->key = mix(mix(((uint64_t)seed << 32) | (uint32_t)a) ^ (uint32_t)b);
+	this->counter = 0;
+}
+
+uint32_t CounterRandom::next_uint32()
+{
+	return mix(this->key + 0x9e3779b97f4a7c15ull*(++this->counter)) >> 32;
+}
+
+float CounterRandom::uniform_float(float min, float max)
+{
+	// 24 bits is all that fits in a float
+	return lerp(min, max, (this->next_uint32() >> 8) / (float)(1 << 24));
+}
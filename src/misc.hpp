@@ -1,9 +1,27 @@
 #ifndef MISC_HPP
 #define MISC_HPP
 
+#include <cstdint>
+
 template<typename T> T lerp(T a, T b, float t) { return a + (b-a)*t; }
 inline float unlerp(float a, float b, float lerped) { return (lerped-a)/(b-a); }
 
 float uniform_random_float(float min, float max);
 
+/*
+Counter-based random numbers: the n'th number depends only on n and the
+arguments given to the constructor. Unlike std::rand(), this can be used on
+any thread, and doesn't depend on what was generated before.
+*/
+class CounterRandom {
+public:
+	CounterRandom(uint32_t seed, int32_t a, int32_t b);
+	uint32_t next_uint32();
+	float uniform_float(float min, float max);
+
+private:
+	uint64_t key;
+	uint64_t counter;
+};
+
 #endif
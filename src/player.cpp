@@ -6,19 +6,12 @@
 #include "entity.hpp"
 #include "camera.hpp"
 #include "misc.hpp"
+#include "shapes.hpp"
 #include "surface.hpp"
 #include "linalg.hpp"
 
-static vec4 tu_to_3d_point_and_brightness(vec2 tu)
-{
-	using std::cos, std::sin, std::log;
-	float t = tu.x, u = tu.y;
-	float r = 2 + cos(u);
-	return vec4{ r*cos(t), (1 + sin(u)), r*sin(t), lerp<float>(0.3f, 0.6f, unlerp(-1,1,-cos(t))) };
-}
-
 static Surface surface = Surface(
-	tu_to_3d_point_and_brightness,
+	PlayerShape(),
 	0, 2*std::acos(-1.0f), 50,
 	0, 2*std::acos(-1.0f), 50,
 	1.0f, 0.6f, 0.0f);
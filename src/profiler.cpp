@@ -0,0 +1,178 @@
+#include "profiler.hpp"
+#include "config.hpp"
+
+#if PROFILER
+
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "log.hpp"
+
+struct ProfilerEvent {
+	const char *name;
+	Uint64 start, end;
+};
+
+/*
+Only the owning thread writes events. Other threads read events below
+write_count. The oldest events get overwritten when the buffer is full, so
+readers stay away from the oldest half of the buffer.
+*/
+struct ThreadEvents {
+	std::string thread_name;
+	std::vector<ProfilerEvent> ring = std::vector<ProfilerEvent>(PROFILER_EVENTS_PER_THREAD);
+	std::atomic<Uint64> write_count{0};
+	Uint64 summarized_count = 0;  // used only by profiler_end_frame()
+};
+
+static std::mutex threads_lock;  // for adding a thread and thread names, not for recording
+static std::vector<std::unique_ptr<ThreadEvents>> threads;
+static thread_local ThreadEvents *this_thread = nullptr;
+static const Uint64 program_start = SDL_GetPerformanceCounter();
+
+// Time spent on each name, one value per frame. Main thread only.
+static std::unordered_map<const char *, std::vector<float>> ms_per_frame;
+static int frames = 0;
+
+static ThreadEvents& get_this_thread()
+{
+	if (!this_thread) {
+		std::lock_guard<std::mutex> lock(threads_lock);
+		threads.push_back(std::make_unique<ThreadEvents>());
+		this_thread = threads.back().get();
+		this_thread->thread_name = "Thread " + std::to_string(threads.size());
+	}
+	return *this_thread;
+}
+
+ProfilerScope::~ProfilerScope()
+{
+	ThreadEvents& t = get_this_thread();
+	Uint64 n = t.write_count.load(std::memory_order_relaxed);
+	t.ring[n % PROFILER_EVENTS_PER_THREAD] = ProfilerEvent{ this->name, this->start, SDL_GetPerformanceCounter() };
+	t.write_count.store(n + 1, std::memory_order_release);
+}
+
+void profiler_set_thread_name(const char *name)
+{
+	ThreadEvents& t = get_this_thread();
+	std::lock_guard<std::mutex> lock(threads_lock);  // write_chrome_trace() may be reading it
+	t.thread_name = name;
+}
+
+// Calls f(event) for events that can be safely read, starting at given index
+template<typename F> static Uint64 for_each_event(const ThreadEvents& t, Uint64 start_index, F f)
+{
+	Uint64 end = t.write_count.load(std::memory_order_acquire);
+	Uint64 oldest_safe = (end > PROFILER_EVENTS_PER_THREAD/2) ? end - PROFILER_EVENTS_PER_THREAD/2 : 0;
+	for (Uint64 i = std::max(start_index, oldest_safe); i < end; i++)
+		f(t.ring[i % PROFILER_EVENTS_PER_THREAD]);
+	return end;
+}
+
+static double counter_to_ms(Uint64 counter_diff)
+{
+	return counter_diff * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+void profiler_end_frame()
+{
+	std::unordered_map<const char *, double> this_frame;
+	{
+		std::lock_guard<std::mutex> lock(threads_lock);
+		for (std::unique_ptr<ThreadEvents>& t : threads) {
+			t->summarized_count = for_each_event(*t, t->summarized_count, [&](const ProfilerEvent& e) {
+				this_frame[e.name] += counter_to_ms(e.end - e.start);
+			});
+		}
+	}
+
+	for (const auto& [name, ms] : this_frame) {
+		std::vector<float>& history = ms_per_frame[name];
+		history.resize(frames);  // zeros for frames before this name appeared
+		history.push_back((float)ms);
+	}
+	frames++;
+	for (auto& [name, history] : ms_per_frame)
+		history.resize(frames);  // zero for names not seen in this frame
+}
+
+static void log_summary()
+{
+	// Same name can be in several string literals, e.g. in different files
+	std::map<std::string, std::vector<float>> by_name;
+	for (const auto& [name, history] : ms_per_frame) {
+		std::vector<float>& combined = by_name[name];
+		combined.resize(history.size());
+		for (int i = 0; i < history.size(); i++)
+			combined[i] += history[i];
+	}
+
+	log_printf("Milliseconds per frame over %d frames:", frames);
+	for (auto& [name, history] : by_name) {
+		if (history.empty())
+			continue;
+		std::sort(history.begin(), history.end());
+		auto percentile = [&history](float p) { return history[(int)(p*(history.size() - 1))]; };
+		log_printf("  %-25s median %7.3f   95%% %7.3f   99%% %7.3f   max %7.3f",
+			name.c_str(), percentile(0.5f), percentile(0.95f), percentile(0.99f), history.back());
+	}
+}
+
+static void write_json_string(FILE *f, const std::string& s)
+{
+	std::fputc('"', f);
+	for (char c : s) {
+		if (c == '"' || c == '\\')
+			std::fputc('\\', f);
+		std::fputc(c, f);
+	}
+	std::fputc('"', f);
+}
+
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+static void write_chrome_trace(const char *path)
+{
+	FILE *f = std::fopen(path, "w");
+	if (!f) {
+		log_printf("Can't write profiler trace to \"%s\"", path);
+		return;
+	}
+
+	std::fprintf(f, "{\"traceEvents\": [\n");
+	bool first = true;
+
+	std::lock_guard<std::mutex> lock(threads_lock);
+	for (int tid = 0; tid < threads.size(); tid++) {
+		std::fprintf(f, "%s{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": ", first ? "" : ",\n", tid);
+		write_json_string(f, threads[tid]->thread_name);
+		std::fprintf(f, "}}");
+		first = false;
+
+		for_each_event(*threads[tid], 0, [&](const ProfilerEvent& e) {
+			std::fprintf(f, ",\n{\"ph\": \"X\", \"name\": ");
+			write_json_string(f, e.name);
+			std::fprintf(f, ", \"pid\": 0, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+				tid, 1000*counter_to_ms(e.start - program_start), 1000*counter_to_ms(e.end - e.start));
+		});
+	}
+
+	std::fprintf(f, "\n]}\n");
+	std::fclose(f);
+	log_printf("Wrote profiler trace to \"%s\"", path);
+}
+
+void profiler_finish()
+{
+	log_summary();
+	write_chrome_trace(PROFILER_TRACE_FILE);
+}
+
+#endif
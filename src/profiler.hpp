@@ -0,0 +1,49 @@
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include "config.hpp"
+
+/*
+Measures how long things take. Put PROFILE_SCOPE("name") at the start of a
+block, and the time until the end of the block gets recorded. Each thread
+records into its own ring buffer, so this is cheap and needs no locking.
+
+When the game quits, profiler_finish() logs percentiles of time spent per frame
+for each name, and writes the recorded events to PROFILER_TRACE_FILE. Open it
+in chrome://tracing or https://ui.perfetto.dev to see what each thread did.
+
+With PROFILER set to 0 in config.hpp, all of this compiles to nothing.
+*/
+#if PROFILER
+
+#include <SDL2/SDL.h>
+
+#define PROFILER_CONCAT_HELPER(a, b) a##b
+#define PROFILER_CONCAT(a, b) PROFILER_CONCAT_HELPER(a, b)
+#define PROFILE_SCOPE(NAME) ProfilerScope PROFILER_CONCAT(profiler_scope_, __LINE__)(NAME)
+
+class ProfilerScope {
+public:
+	// name must be a string literal, or otherwise live until the end of the program
+	ProfilerScope(const char *name) : name(name), start(SDL_GetPerformanceCounter()) {}
+	~ProfilerScope();
+	ProfilerScope(const ProfilerScope&) = delete;
+
+private:
+	const char *name;
+	Uint64 start;
+};
+
+void profiler_set_thread_name(const char *name);  // shown in the trace file
+void profiler_end_frame();  // call from main thread
+void profiler_finish();
+
+#else
+
+#define PROFILE_SCOPE(NAME) ((void)0)
+inline void profiler_set_thread_name(const char *) {}
+inline void profiler_end_frame() {}
+inline void profiler_finish() {}
+
+#endif
+#endif
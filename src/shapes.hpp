@@ -0,0 +1,69 @@
+#ifndef SHAPES_HPP
+#define SHAPES_HPP
+
+#include <cmath>
+#include <type_traits>
+#include "linalg.hpp"
+#include "misc.hpp"
+
+/*
+Shapes of things other than the map are parametric surfaces. A shape is a type
+with a static function that converts surface parameters (t,u) to a point on the
+surface and its brightness. The functions are here, and not in .cpp files, so
+that they can be inlined into vertex generation and collision checking.
+
+A shape can also have tu_to_3d_derivatives(), which computes partial
+derivatives of the point with respect to t and u. Collision checking uses
+them if they exist, and otherwise estimates them numerically.
+
+When adding a shape, add it to ShapeId and to the switch statements in entity.cpp.
+*/
+enum class ShapeId { Player, Enemy };
+
+struct PlayerShape {
+	static constexpr ShapeId id = ShapeId::Player;
+
+	static inline vec4 tu_to_3d_point_and_brightness(vec2 tu)
+	{
+		using std::cos, std::sin;
+		float t = tu.x, u = tu.y;
+		float r = 2 + cos(u);
+		return vec4{ r*cos(t), (1 + sin(u)), r*sin(t), lerp<float>(0.3f, 0.6f, unlerp(-1,1,-cos(t))) };
+	}
+
+	static inline void tu_to_3d_derivatives(vec2 tu, vec3& dt, vec3& du)
+	{
+		using std::cos, std::sin;
+		float t = tu.x, u = tu.y;
+		float r = 2 + cos(u);
+		dt = vec3{ -r*sin(t), 0, r*cos(t) };
+		du = vec3{ -sin(u)*cos(t), cos(u), -sin(u)*sin(t) };
+	}
+};
+
+struct EnemyShape {
+	static constexpr ShapeId id = ShapeId::Enemy;
+
+	static inline vec4 tu_to_3d_point_and_brightness(vec2 tu)
+	{
+		using std::cos, std::sin;
+		float t = tu.x, u = tu.y;
+		return vec4{ 2*u*cos(t), 6*(1 - u*u) + 0.6f*u*u*u*(1+sin(10*t)), 2*u*sin(t), lerp<float>(0.1f, 0.4f, 1-u) };
+	}
+
+	static inline void tu_to_3d_derivatives(vec2 tu, vec3& dt, vec3& du)
+	{
+		using std::cos, std::sin;
+		float t = tu.x, u = tu.y;
+		dt = vec3{ -2*u*sin(t), 6*u*u*u*cos(10*t), 2*u*cos(t) };
+		du = vec3{ 2*cos(t), -12*u + 1.8f*u*u*(1+sin(10*t)), 2*sin(t) };
+	}
+};
+
+// ShapeHasDerivatives<Shape>::value is true if Shape has tu_to_3d_derivatives()
+template<typename Shape, typename = void>
+struct ShapeHasDerivatives : std::false_type {};
+template<typename Shape>
+struct ShapeHasDerivatives<Shape, std::void_t<decltype(&Shape::tu_to_3d_derivatives)>> : std::true_type {};
+
+#endif
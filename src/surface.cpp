@@ -1,89 +1,112 @@
 #include "surface.hpp"
+#include <algorithm>
 #include <array>
-#include <functional>
 #include <string>
 #include <vector>
 #include "camera.hpp"
 #include "map.hpp"
+#include "mesh_collision.hpp"
 #include "misc.hpp"
+#include "gl_state.hpp"
 #include "opengl_boilerplate.hpp"
 #include "log.hpp"
 
 
-static std::vector<std::array<vec4, 3>> create_vertex_data(
-	std::function<vec4(vec2)> tu_to_3d_point_and_brightness,
-	float tmin, float tmax, int tstepcount,
-	float umin, float umax, int ustepcount)
+static SurfaceBounds compute_bounds(const std::vector<std::array<vec4, 3>>& vertex_data)
 {
-	std::vector<std::array<vec4, 3>> vertex_data = {};
-	for (int tstep = 0; tstep < tstepcount; tstep++) {
-		for (int ustep = 0; ustep < ustepcount; ustep++) {
-			float t1 = lerp<float>(tmin, tmax,  tstep   /float(tstepcount));
-			float t2 = lerp<float>(tmin, tmax, (tstep+1)/float(tstepcount));
-			float u1 = lerp<float>(umin, umax,  ustep   /float(ustepcount));
-			float u2 = lerp<float>(umin, umax, (ustep+1)/float(ustepcount));
-
-			vec4 a = tu_to_3d_point_and_brightness(vec2{t1, u1});
-			vec4 b = tu_to_3d_point_and_brightness(vec2{t1, u2});
-			vec4 c = tu_to_3d_point_and_brightness(vec2{t2, u1});
-			vec4 d = tu_to_3d_point_and_brightness(vec2{t2, u2});
-
-			vertex_data.push_back(std::array<vec4, 3>{a,b,c});
-			vertex_data.push_back(std::array<vec4, 3>{d,b,c});
+	vec3 min = vertex_data[0][0].xyz();
+	vec3 max = min;
+	float longest_edge = 0;
+
+	for (const std::array<vec4, 3>& triangle : vertex_data) {
+		for (int i = 0; i < 3; i++) {
+			vec3 p = triangle[i].xyz();
+			min = vec3{ std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z) };
+			max = vec3{ std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z) };
+			longest_edge = std::max(longest_edge, (p - triangle[(i+1)%3].xyz()).length());
 		}
 	}
-	return vertex_data;
+
+	/*
+	The surface can bulge a bit between the vertices. A point of the surface is
+	never further than longest_edge from the nearest vertex, unless the
+	tessellation is way too coarse to render nicely anyway.
+	*/
+	vec3 padding = vec3{ longest_edge, longest_edge, longest_edge };
+	min -= padding;
+	max += padding;
+
+	SurfaceBounds bounds;
+	bounds.center = (min + max)/2;
+	bounds.half_size = (max - min)/2;
+	bounds.radius = 0;
+	for (const std::array<vec4, 3>& triangle : vertex_data) {
+		for (const vec4& v : triangle)
+			bounds.radius = std::max(bounds.radius, (v.xyz() - bounds.center).length());
+	}
+	bounds.radius += longest_edge;
+	return bounds;
 }
 
-Surface::Surface(
-	std::function<vec4(vec2)> tu_to_3d_point_and_brightness,
-	float tmin, float tmax, int tstepcount,
-	float umin, float umax, int ustepcount,
-	float r, float g, float b)
-	:
-		tu_to_3d_point_and_brightness(tu_to_3d_point_and_brightness),
-		tmin(tmin), tmax(tmax), umin(umin), umax(umax),
-		r(r),g(g),b(b)
+void Surface::prepare_collision_data()
 {
-	this->vertex_data = create_vertex_data(
-		tu_to_3d_point_and_brightness,
-		tmin, tmax, tstepcount,
-		umin, umax, ustepcount);
+	this->bounds = compute_bounds(this->vertex_data);
+
+	std::vector<std::array<vec3, 3>> triangles;
+	for (const std::array<vec4, 3>& t : this->vertex_data)
+		triangles.push_back({ t[0].xyz(), t[1].xyz(), t[2].xyz() });
+	this->mesh = TriangleBVH(triangles);
 }
 
-void Surface::prepare_shader_program()
+// Same shader program for all surfaces, so switching between them is cheap
+static GLuint shader_program = 0;
+static GLint rgb_uniform, world2cam_uniform;
+
+static void create_shader_program()
 {
 	std::string vertex_shader =
 		"#version 330\n"
 		"\n"
 		"layout(location = 0) in vec4 positionAndColor;\n"
-		"uniform vec3 addToLocation;\n"
+		"layout(location = 1) in vec3 addToLocation;\n"  // per instance
+		"layout(location = 2) in vec3 mapRotationRow0;\n"
+		"layout(location = 3) in vec3 mapRotationRow1;\n"
+		"layout(location = 4) in vec3 mapRotationRow2;\n"
 		"uniform vec3 rgbWithMaxBrightness;\n"
 		"uniform mat3 world2cam;\n"
-		"uniform mat3 mapRotation;\n"
 		"smooth out vec4 vertexToFragmentColor;\n"
 		"\n"
 		"BOILERPLATE_GOES_HERE\n"
 		"\n"
 		"void main(void)\n"
 		"{\n"
-		"    vec3 pos = world2cam*(mapRotation*positionAndColor.xyz + addToLocation);\n"
+		"    vec3 p = positionAndColor.xyz;\n"
+		"    vec3 rotated = vec3(dot(mapRotationRow0, p), dot(mapRotationRow1, p), dot(mapRotationRow2, p));\n"
+		"    vec3 pos = world2cam*(rotated + addToLocation);\n"
 		"    gl_Position = locationFromCameraToGlPosition(pos);\n"
 		"    vertexToFragmentColor = darkerAtDistance(rgbWithMaxBrightness*positionAndColor.w, pos);\n"
 		"}\n"
 		;
-	this->shader_program = OpenglBoilerplate::create_shader_program(vertex_shader);
+	shader_program = OpenglBoilerplate::create_shader_program(vertex_shader);
+	rgb_uniform = GlState::get_uniform_location(shader_program, "rgbWithMaxBrightness");
+	world2cam_uniform = GlState::get_uniform_location(shader_program, "world2cam");
+}
+
+void Surface::prepare_buffers()
+{
+	gl_counted(glGenBuffers(1, &this->vertex_buffer_object));
+	GlState::bind_array_buffer(this->vertex_buffer_object);
+	gl_counted(glBufferData(GL_ARRAY_BUFFER, sizeof(this->vertex_data[0])*vertex_data.size(), this->vertex_data.data(), GL_DYNAMIC_DRAW));
 
-	glGenBuffers(1, &this->vertex_buffer_object);
-	glBindBuffer(GL_ARRAY_BUFFER, this->vertex_buffer_object);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(this->vertex_data[0])*vertex_data.size(), this->vertex_data.data(), GL_DYNAMIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	gl_counted(glGenBuffers(1, &this->instance_buffer_object));
 }
 
 mat3 Surface::get_rotation_matrix(Map& map, vec3 location) const
 {
-	vec3 normal_vector = map.get_normal_vector(location.x, location.z);
-	float above_floor = location.y - map.get_height(location.x, location.z);
+	float map_height;
+	vec3 normal_vector;
+	map.get_heights_and_normals(1, &location.x, &location.z, &map_height, &normal_vector);
+	float above_floor = location.y - map_height;
 	if (above_floor > 0) {
 		// When the player or enemy is flying, don't follow ground shapes much
 		normal_vector /= normal_vector.length();
@@ -95,36 +118,49 @@ mat3 Surface::get_rotation_matrix(Map& map, vec3 location) const
 
 void Surface::render(const Camera& cam, Map& map, vec3 location)
 {
-	if (this->shader_program == 0) {
-		log_printf("Creating shader program for surface");
-		this->prepare_shader_program();
+	this->render_many(cam, map, &location, 1);
+}
+
+int Surface::render_many(const Camera& cam, Map& map, const vec3 *locations, int count)
+{
+	// Contains the surface however it's rotated, so culling doesn't need the rotation
+	float radius = this->bounds.center.length() + this->bounds.radius;
+	Frustum frustum(cam);
+
+	this->instances.clear();
+	for (int i = 0; i < count; i++) {
+		if (frustum.sphere_is_visible(locations[i], radius))
+			this->instances.push_back(Instance{ locations[i] - cam.location, this->get_rotation_matrix(map, locations[i]) });
+	}
+	if (this->instances.empty())
+		return 0;
+
+	if (shader_program == 0) {
+		log_printf("Creating shader program for surfaces");
+		create_shader_program();
+	}
+	if (this->vertex_buffer_object == 0)
+		this->prepare_buffers();
+
+	static_assert(sizeof(Instance) == 12*sizeof(float), "vertex attributes assume no padding");
+
+	GlState::use_program(shader_program);
+	gl_counted(glUniform3f(rgb_uniform, this->r, this->g, this->b));
+	gl_counted(glUniformMatrix3fv(world2cam_uniform, 1, true, &cam.world2cam.rows[0][0]));
+
+	GlState::enable_attributes(0b11111);
+	GlState::bind_array_buffer(this->vertex_buffer_object);
+	gl_counted(glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0));
+
+	// Same vertex_data for each instance, and these change once per instance
+	GlState::bind_array_buffer(this->instance_buffer_object);
+	gl_counted(glBufferData(GL_ARRAY_BUFFER, sizeof(Instance)*this->instances.size(), this->instances.data(), GL_STREAM_DRAW));
+	const float *offset = 0;
+	for (int attrib = 1; attrib <= 4; attrib++) {
+		gl_counted(glVertexAttribPointer(attrib, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), offset + 3*(attrib-1)));
+		GlState::set_attribute_divisor(attrib, 1);
 	}
 
-	glUseProgram(this->shader_program);
-
-	glUniform3f(
-		glGetUniformLocation(this->shader_program, "rgbWithMaxBrightness"),
-		this->r, this->g, this->b);
-
-	vec3 relative_location = location - cam.location;
-	glUniform3f(
-		glGetUniformLocation(this->shader_program, "addToLocation"),
-		relative_location.x, relative_location.y, relative_location.z);
-
-	glUniformMatrix3fv(
-		glGetUniformLocation(this->shader_program, "world2cam"),
-		1, true, &cam.world2cam.rows[0][0]);
-
-	mat3 rotation = this->get_rotation_matrix(map, location);
-	glUniformMatrix3fv(
-		glGetUniformLocation(this->shader_program, "mapRotation"),
-		1, true, &rotation.rows[0][0]);
-
-	glBindBuffer(GL_ARRAY_BUFFER, this->vertex_buffer_object);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0);
-	glDrawArrays(GL_TRIANGLES, 0, 3*this->vertex_data.size());
-	glDisableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glUseProgram(0);
+	gl_counted(glDrawArraysInstanced(GL_TRIANGLES, 0, 3*this->vertex_data.size(), this->instances.size()));
+	return this->instances.size();
 }
@@ -3,31 +3,99 @@
 
 #include <GL/glew.h>
 #include <array>
-#include <functional>
 #include <vector>
 #include "camera.hpp"
 #include "linalg.hpp"
 #include "map.hpp"
+#include "mesh_collision.hpp"
+#include "misc.hpp"
+#include "shapes.hpp"
+
+/*
+Bounding sphere and box of a surface, in the surface's own coordinates (before
+rotating and moving it to its location). The box rotates with the surface, so
+it's an oriented bounding box. Both contain the whole surface, not just the
+vertices used for rendering.
+*/
+struct SurfaceBounds {
+	vec3 center;  // of both sphere and box
+	float radius;
+	vec3 half_size;  // box is center-half_size ... center+half_size
+};
+
+// Template so that Shape::tu_to_3d_point_and_brightness() gets inlined
+template<typename Shape>
+std::vector<std::array<vec4, 3>> create_vertex_data(
+	float tmin, float tmax, int tstepcount,
+	float umin, float umax, int ustepcount)
+{
+	std::vector<std::array<vec4, 3>> vertex_data = {};
+	for (int tstep = 0; tstep < tstepcount; tstep++) {
+		for (int ustep = 0; ustep < ustepcount; ustep++) {
+			float t1 = lerp<float>(tmin, tmax,  tstep   /float(tstepcount));
+			float t2 = lerp<float>(tmin, tmax, (tstep+1)/float(tstepcount));
+			float u1 = lerp<float>(umin, umax,  ustep   /float(ustepcount));
+			float u2 = lerp<float>(umin, umax, (ustep+1)/float(ustepcount));
+
+			vec4 a = Shape::tu_to_3d_point_and_brightness(vec2{t1, u1});
+			vec4 b = Shape::tu_to_3d_point_and_brightness(vec2{t1, u2});
+			vec4 c = Shape::tu_to_3d_point_and_brightness(vec2{t2, u1});
+			vec4 d = Shape::tu_to_3d_point_and_brightness(vec2{t2, u2});
+
+			vertex_data.push_back(std::array<vec4, 3>{a,b,c});
+			vertex_data.push_back(std::array<vec4, 3>{d,b,c});
+		}
+	}
+	return vertex_data;
+}
 
 class Surface {
 public:
-	std::function<vec4(vec2)> tu_to_3d_point_and_brightness;
+	ShapeId shape;  // tells which type from shapes.hpp this is, see collides_with()
 	float tmin, tmax;
 	float umin, umax;
+	SurfaceBounds bounds;
+	TriangleBVH mesh;  // same triangles that are rendered
+
+	// Shape is one of the types in shapes.hpp, e.g. Surface(PlayerShape(), ...)
+	template<typename Shape>
 	Surface(
-		std::function<vec4(vec2)> tu_to_3d_point_and_brightness,
+		Shape,
 		float tmin, float tmax, int tstepcount,
 		float umin, float umax, int ustepcount,
-		float r, float g, float b);
+		float r, float g, float b)
+		:
+			shape(Shape::id),
+			tmin(tmin), tmax(tmax), umin(umin), umax(umax),
+			vertex_data(create_vertex_data<Shape>(tmin, tmax, tstepcount, umin, umax, ustepcount)),
+			r(r),g(g),b(b)
+	{
+		this->prepare_collision_data();
+	}
+
 	void render(const Camera& cam, Map& map, vec3 location);
 
+	/*
+	Draws the surface at many locations with one draw call (instanced rendering).
+	Locations that the camera can't see are skipped. Returns how many were drawn.
+	*/
+	int render_many(const Camera& cam, Map& map, const vec3 *locations, int count);
+
 	mat3 get_rotation_matrix(Map& map, vec3 location) const;
 
 private:
+	// Sent to gpu for each location drawn
+	struct Instance {
+		vec3 location;  // relative to camera
+		mat3 rotation;
+	};
+
 	std::vector<std::array<vec4, 3>> vertex_data;
-	void prepare_shader_program();
-	GLuint shader_program;
-	GLuint vertex_buffer_object;
+	std::vector<Instance> instances;  // kept here to reuse the memory
+	void prepare_collision_data();
+	void prepare_buffers();
+	GLuint vertex_buffer_object = 0;
+	GLuint instance_buffer_object = 0;
 	float r, g, b;
 };
 
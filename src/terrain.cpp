@@ -0,0 +1,256 @@
+#include "terrain.hpp"
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "log.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TERRAIN_X86 1
+#endif
+
+// The original, slow and simple way. Other kernels are compared against this.
+static void scalar_kernel(
+	const GaussianCurveMountain *mountains, int nmountains,
+	int xmin, int xcount, int zmin, int zcount,
+	float *out, int stride)
+{
+	for (int xidx = 0; xidx < xcount; xidx++) {
+		for (int zidx = 0; zidx < zcount; zidx++) {
+			float x = xmin + xidx;
+			float z = zmin + zidx;
+
+			float y = 0;
+			for (int i = 0; i < nmountains; i++) {
+				float dx = x - mountains[i].centerx;
+				float dz = z - mountains[i].centerz;
+				float xzscale = mountains[i].xzscale;
+				y += mountains[i].yscale * expf(-1/(xzscale*xzscale) * (dx*dx + dz*dz));
+			}
+			out[xidx*stride + zidx] = y;
+		}
+	}
+}
+
+/*
+e^(-(dx^2 + dz^2)/s^2) = e^(-dx^2/s^2) * e^(-dz^2/s^2)
+
+The z factors are computed once, and then each row (fixed x) is a linear
+combination of them. Most mountains are narrow, so for a given row, the x
+factor is often exactly zero and the mountain can be skipped entirely.
+*/
+struct SeparableTables {
+	int zpadded;  // multiple of 8, so that simd loops don't need to handle leftovers
+	std::vector<float> zfactors;  // zpadded floats for each mountain
+	std::vector<const float*> rowfactors;  // for current row: z factors of mountains that matter
+	std::vector<float> coeffs;  // for current row: yscale * x factor
+	std::vector<float> row;  // zpadded floats
+
+	SeparableTables(const GaussianCurveMountain *mountains, int nmountains, int zmin, int zcount)
+	{
+		this->zpadded = (zcount + 7) / 8 * 8;
+		this->zfactors.resize(nmountains*this->zpadded);
+		this->rowfactors.reserve(nmountains);
+		this->coeffs.reserve(nmountains);
+		this->row.resize(this->zpadded);
+
+		for (int i = 0; i < nmountains; i++) {
+			float *zf = &this->zfactors[i*this->zpadded];
+			float xzscale = mountains[i].xzscale;
+			for (int zidx = 0; zidx < zcount; zidx++) {
+				float dz = (zmin + zidx) - mountains[i].centerz;
+				zf[zidx] = expf(-1/(xzscale*xzscale) * (dz*dz));
+			}
+			std::fill(zf + zcount, zf + this->zpadded, 0.0f);
+		}
+	}
+
+	void prepare_row(const GaussianCurveMountain *mountains, int nmountains, float x)
+	{
+		this->rowfactors.clear();
+		this->coeffs.clear();
+		for (int i = 0; i < nmountains; i++) {
+			float dx = x - mountains[i].centerx;
+			float xzscale = mountains[i].xzscale;
+			float c = mountains[i].yscale * expf(-1/(xzscale*xzscale) * (dx*dx));
+			if (c != 0) {
+				this->rowfactors.push_back(&this->zfactors[i*this->zpadded]);
+				this->coeffs.push_back(c);
+			}
+		}
+	}
+};
+
+/*
+Written so that gcc -O2 compiles this to SSE instructions: n is a multiple of
+8, so there are no leftovers to handle, and __restrict parameters mean that
+there is no runtime check for overlapping arrays.
+*/
+static void add_scaled(float *__restrict row, const float *__restrict zf, float c, int n)
+{
+	for (int zidx = 0; zidx < n; zidx += 8)
+#pragma GCC unroll 8
+		for (int j = 0; j < 8; j++)
+			row[zidx + j] += c*zf[zidx + j];
+}
+
+static void accumulate_row_plain(SeparableTables& tables)
+{
+	std::fill(tables.row.begin(), tables.row.end(), 0.0f);
+	for (int k = 0; k < tables.coeffs.size(); k++)
+		add_scaled(tables.row.data(), tables.rowfactors[k], tables.coeffs[k], tables.zpadded);
+}
+
+#ifdef TERRAIN_X86
+__attribute__((target("avx2,fma")))
+static void accumulate_row_avx2(SeparableTables& tables)
+{
+	int n = tables.coeffs.size();
+	for (int zidx = 0; zidx < tables.zpadded; zidx += 8) {
+		__m256 acc = _mm256_setzero_ps();
+		for (int k = 0; k < n; k++) {
+			__m256 zf = _mm256_loadu_ps(tables.rowfactors[k] + zidx);
+			acc = _mm256_fmadd_ps(_mm256_set1_ps(tables.coeffs[k]), zf, acc);
+		}
+		_mm256_storeu_ps(&tables.row[zidx], acc);
+	}
+}
+#endif
+
+static void separable_kernel(
+	void (*accumulate_row)(SeparableTables&),
+	const GaussianCurveMountain *mountains, int nmountains,
+	int xmin, int xcount, int zmin, int zcount,
+	float *out, int stride)
+{
+	SeparableTables tables(mountains, nmountains, zmin, zcount);
+	for (int xidx = 0; xidx < xcount; xidx++) {
+		tables.prepare_row(mountains, nmountains, xmin + xidx);
+		accumulate_row(tables);
+		std::memcpy(&out[xidx*stride], tables.row.data(), zcount*sizeof(float));
+	}
+}
+
+void compute_mountain_heights(
+	TerrainKernel kernel,
+	const GaussianCurveMountain *mountains, int nmountains,
+	int xmin, int xcount, int zmin, int zcount,
+	float *out, int stride)
+{
+	switch(kernel) {
+		case TerrainKernel::Scalar:
+			scalar_kernel(mountains, nmountains, xmin, xcount, zmin, zcount, out, stride);
+			break;
+		case TerrainKernel::Separable:
+			separable_kernel(accumulate_row_plain, mountains, nmountains, xmin, xcount, zmin, zcount, out, stride);
+			break;
+#ifdef TERRAIN_X86
+		case TerrainKernel::AVX2:
+			separable_kernel(accumulate_row_avx2, mountains, nmountains, xmin, xcount, zmin, zcount, out, stride);
+			break;
+#endif
+		default:
+			log_printf_abort("terrain kernel %s is not available", terrain_kernel_name(kernel));
+	}
+}
+
+const char *terrain_kernel_name(TerrainKernel kernel)
+{
+	switch(kernel) {
+		case TerrainKernel::Scalar: return "scalar";
+		case TerrainKernel::Separable: return "separable";
+		case TerrainKernel::AVX2: return "avx2";
+	}
+	return "???";
+}
+
+static bool kernel_is_supported(TerrainKernel kernel)
+{
+	switch(kernel) {
+		case TerrainKernel::Scalar:
+		case TerrainKernel::Separable:
+			return true;
+#ifdef TERRAIN_X86
+		case TerrainKernel::AVX2:
+			// accumulate_row_avx2() is compiled with fma, and some CPUs and VMs have avx2 without it
+			return SDL_HasAVX2() && __builtin_cpu_supports("fma");
+#endif
+		default:
+			return false;
+	}
+}
+
+// Run the kernel on mountains similar to what the game uses, and compare with scalar kernel
+static bool kernel_agrees_with_scalar(TerrainKernel kernel)
+{
+	constexpr int n = 121;  // same as size of raw_y_table
+	std::vector<GaussianCurveMountain> mountains;
+	unsigned int state = 1234;
+	auto random = [&state](float min, float max) {
+		state = state*1103515245u + 12345u;
+		return min + (max - min)*((state >> 8) / float(1 << 24));
+	};
+	for (int i = 0; i < 100; i++) {
+		float h = (i < 5) ? random(-30, 30) : random(-1.5f, 1.5f);
+		float w = std::min(random(2, 5)*std::abs(h), 13.0f);
+		mountains.push_back(GaussianCurveMountain{ std::max(w, 0.1f), h, random(0, 40), random(0, 40) });
+	}
+
+	std::vector<float> expected(n*n), actual(n*n);
+	compute_mountain_heights(TerrainKernel::Scalar, mountains.data(), mountains.size(), -40, n, -40, n, expected.data(), n);
+	compute_mountain_heights(kernel, mountains.data(), mountains.size(), -40, n, -40, n, actual.data(), n);
+
+	float maxdiff = 0;
+	for (int i = 0; i < n*n; i++)
+		maxdiff = std::max(maxdiff, std::abs(expected[i] - actual[i]));
+
+	if (maxdiff > TERRAIN_KERNEL_TOLERANCE) {
+		log_printf("%s terrain kernel differs from scalar kernel by %g, more than tolerance %g",
+			terrain_kernel_name(kernel), maxdiff, TERRAIN_KERNEL_TOLERANCE);
+		return false;
+	}
+	return true;
+}
+
+static TerrainKernel choose_kernel()
+{
+	TerrainKernel all[] = { TerrainKernel::Scalar, TerrainKernel::Separable, TerrainKernel::AVX2 };
+	TerrainKernel result = TerrainKernel::Separable;
+	for (TerrainKernel k : all) {
+		if (kernel_is_supported(k))
+			result = k;  // later = faster
+	}
+
+	const char *requested = std::getenv("TERRAIN_KERNEL");
+	if (requested) {
+		TerrainKernel *found = std::find_if(std::begin(all), std::end(all),
+			[requested](TerrainKernel k) { return std::strcmp(terrain_kernel_name(k), requested) == 0; });
+		if (found == std::end(all) || !kernel_is_supported(*found))
+			log_printf("TERRAIN_KERNEL=%s is unknown or not supported by CPU, ignoring", requested);
+		else
+			result = *found;
+	}
+
+	if (result != TerrainKernel::Scalar && !kernel_agrees_with_scalar(result))
+		result = TerrainKernel::Scalar;
+
+	log_printf("Using %s terrain kernel", terrain_kernel_name(result));
+	return result;
+}
+
+TerrainKernel get_terrain_kernel()
+{
+	static const TerrainKernel kernel = choose_kernel();  // thread safe in c++11 and newer
+	return kernel;
+}
+
+void compute_mountain_heights(
+	const GaussianCurveMountain *mountains, int nmountains,
+	int xmin, int xcount, int zmin, int zcount,
+	float *out, int stride)
+{
+	compute_mountain_heights(get_terrain_kernel(), mountains, nmountains, xmin, xcount, zmin, zcount, out, stride);
+}
@@ -0,0 +1,50 @@
+#ifndef TERRAIN_HPP
+#define TERRAIN_HPP
+
+/*
+Height of the map is a sum of gaussian curves, aka mountains:
+
+	y = yscale*e^(-(((x - centerx) / xzscale)^2 + ((z - centerz) / xzscale)^2))
+
+yscale can be negative, xzscale can't.
+*/
+struct GaussianCurveMountain {
+	float xzscale, yscale, centerx, centerz;
+};
+
+/*
+Evaluating the mountains is the slowest part of generating the map. There are
+several ways to do it, and the fastest one that the CPU supports is picked at
+runtime. You can also pick one with the TERRAIN_KERNEL environment variable,
+e.g. TERRAIN_KERNEL=scalar.
+
+All kernels except scalar use the fact that each gaussian curve is a product
+of an x factor and a z factor, so there's only one exp() call per row and per
+column, instead of one per point.
+*/
+// Values are saved in terrain cache files, so don't change them or reuse values of removed kernels (2 was SSE)
+enum class TerrainKernel { Scalar = 0, Separable = 1, AVX2 = 3 };
+
+// Other kernels must produce the same heights as the scalar kernel, up to this much
+static constexpr float TERRAIN_KERNEL_TOLERANCE = 1e-3f;
+
+/*
+Sets out[xidx*stride + zidx] to the sum of all mountains at point (xmin + xidx, zmin + zidx),
+for 0 <= xidx < xcount and 0 <= zidx < zcount. Thread safe.
+*/
+void compute_mountain_heights(
+	const GaussianCurveMountain *mountains, int nmountains,
+	int xmin, int xcount, int zmin, int zcount,
+	float *out, int stride);
+
+// Same as above, but you choose the kernel. The kernel must be supported by the CPU.
+void compute_mountain_heights(
+	TerrainKernel kernel,
+	const GaussianCurveMountain *mountains, int nmountains,
+	int xmin, int xcount, int zmin, int zcount,
+	float *out, int stride);
+
+TerrainKernel get_terrain_kernel();
+const char *terrain_kernel_name(TerrainKernel kernel);
+
+#endif
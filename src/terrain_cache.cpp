@@ -0,0 +1,160 @@
+#include "terrain_cache.hpp"
+#include <SDL2/SDL.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "config.hpp"
+#include "log.hpp"
+#include "terrain.hpp"
+
+static std::atomic<bool> cache_enabled(TERRAIN_CACHE);
+
+// Change this when the map generator changes, so that old files are not used
+static constexpr uint32_t FORMAT_VERSION = 2;  // 2: some builds saved avx2 tiles with kernel number 2
+
+struct FileHeader {
+	char magic[8];  // "terrain\0"
+	uint32_t version;
+	uint32_t kernel;  // kernels give slightly different results, don't mix them
+	uint32_t seed;
+	int32_t startx;
+	int32_t startz;
+	uint32_t size;  // of data after header
+	uint64_t checksum;  // of data after header
+};
+
+static constexpr uint64_t CHECKSUM_START = 0xcbf29ce484222325ull;
+
+// FNV-1a, simple and good enough for noticing truncated or corrupted files. Give previous result as hash to continue.
+static uint64_t compute_checksum(const void *data, size_t size, uint64_t hash = CHECKSUM_START)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static FileHeader create_header(uint32_t seed, int startx, int startz, size_t size)
+{
+	FileHeader header = {};
+	std::memcpy(header.magic, "terrain", 8);
+	header.version = FORMAT_VERSION;
+	header.kernel = (uint32_t)get_terrain_kernel();
+	header.seed = seed;
+	header.startx = startx;
+	header.startz = startz;
+	header.size = size;
+	return header;
+}
+
+static std::string get_path(uint32_t seed, int startx, int startz)
+{
+	return std::string(TERRAIN_CACHE_DIR) + "/" + std::to_string(seed) + "_" + std::to_string(startx) + "_" + std::to_string(startz) + ".bin";
+}
+
+static bool cache_dir_exists()
+{
+	static const bool exists = []() {
+		if (mkdir(TERRAIN_CACHE_DIR, 0777) != 0 && errno != EEXIST) {
+			log_printf("Cannot create terrain cache directory \"%s\" (%s), not caching terrain", TERRAIN_CACHE_DIR, std::strerror(errno));
+			return false;
+		}
+		return true;
+	}();
+	return exists;
+}
+
+static size_t total_size(const size_t *sizes, int nparts)
+{
+	size_t result = 0;
+	for (int i = 0; i < nparts; i++)
+		result += sizes[i];
+	return result;
+}
+
+bool terrain_cache_load(uint32_t seed, int startx, int startz, void *const *parts, const size_t *sizes, int nparts)
+{
+	if (!cache_enabled || !cache_dir_exists())
+		return false;
+
+	size_t size = total_size(sizes, nparts);
+
+	std::string path = get_path(seed, startx, startz);
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;  // not cached
+
+	struct stat st;
+	size_t filesize = sizeof(FileHeader) + size;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size != filesize) {
+		close(fd);
+		return false;
+	}
+
+	void *mapped = mmap(nullptr, filesize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);  // mapping stays valid
+	if (mapped == MAP_FAILED)
+		return false;
+
+	FileHeader expected = create_header(seed, startx, startz, size);
+	FileHeader actual;
+	std::memcpy(&actual, mapped, sizeof actual);
+	const char *payload = (const char *)mapped + sizeof(FileHeader);
+
+	expected.checksum = actual.checksum;
+	bool ok = std::memcmp(&expected, &actual, sizeof actual) == 0 && compute_checksum(payload, size) == actual.checksum;
+	if (ok) {
+		for (int i = 0; i < nparts; i++) {
+			std::memcpy(parts[i], payload, sizes[i]);
+			payload += sizes[i];
+		}
+	} else {
+		log_printf("Ignoring outdated or broken terrain cache file: %s", path.c_str());
+	}
+
+	munmap(mapped, filesize);
+	return ok;
+}
+
+void terrain_cache_save(uint32_t seed, int startx, int startz, const void *const *parts, const size_t *sizes, int nparts)
+{
+	if (!cache_enabled || !cache_dir_exists())
+		return;
+
+	FileHeader header = create_header(seed, startx, startz, total_size(sizes, nparts));
+	header.checksum = CHECKSUM_START;
+	for (int i = 0; i < nparts; i++)
+		header.checksum = compute_checksum(parts[i], sizes[i], header.checksum);
+
+	// Write to temporary file and rename, so that other threads and processes never see half-written files
+	std::string path = get_path(seed, startx, startz);
+	std::string temp_path = path + ".tmp" + std::to_string(SDL_ThreadID());
+
+	FILE *f = std::fopen(temp_path.c_str(), "wb");
+	if (!f) {
+		log_printf("Cannot write terrain cache file %s: %s", temp_path.c_str(), std::strerror(errno));
+		return;
+	}
+	bool ok = std::fwrite(&header, sizeof header, 1, f) == 1;
+	for (int i = 0; i < nparts; i++)
+		ok = ok && std::fwrite(parts[i], sizes[i], 1, f) == 1;
+	ok = (std::fclose(f) == 0) && ok;
+
+	if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+		log_printf("Cannot write terrain cache file %s: %s", path.c_str(), std::strerror(errno));
+		std::remove(temp_path.c_str());
+	}
+}
+
+void terrain_cache_set_enabled(bool enabled)
+{
+	cache_enabled = enabled;
+}
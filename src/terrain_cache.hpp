@@ -0,0 +1,29 @@
+#ifndef TERRAIN_CACHE_HPP
+#define TERRAIN_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+Generated map sections are saved to files in TERRAIN_CACHE_DIR, one file per
+section, so that the next run (or the same run after evicting a section) can
+read them instead of computing everything again. Files are read with mmap().
+
+Each file starts with a header that has a version number, what the file
+contains and a checksum. Files that don't match are ignored and overwritten.
+All functions are thread safe.
+*/
+
+/*
+A file contains nparts parts one after another, parts[i] has sizes[i] bytes.
+Loading copies each part from the mmap()ed file directly to where it goes.
+Returns false if the section isn't in the cache. Then parts are left untouched.
+*/
+bool terrain_cache_load(uint32_t seed, int startx, int startz, void *const *parts, const size_t *sizes, int nparts);
+
+void terrain_cache_save(uint32_t seed, int startx, int startz, const void *const *parts, const size_t *sizes, int nparts);
+
+// Cache is enabled by default if TERRAIN_CACHE is 1. Benchmarks turn it off.
+void terrain_cache_set_enabled(bool enabled);
+
+#endif
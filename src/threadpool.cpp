@@ -0,0 +1,128 @@
+#include "threadpool.hpp"
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <utility>
+#include "log.hpp"
+#include "profiler.hpp"
+
+ThreadPool::ThreadPool(int nthreads) : high_priority_jobs(1024), low_priority_jobs(1024)
+{
+	if (nthreads <= 0)
+		nthreads = std::max(1, SDL_GetCPUCount() - 1);
+
+	this->quit = false;
+	this->jobs_available = SDL_CreateSemaphore(0);
+	SDL_assert(this->jobs_available);
+	this->job_done_mutex = SDL_CreateMutex();
+	SDL_assert(this->job_done_mutex);
+	this->job_done = SDL_CreateCond();
+	SDL_assert(this->job_done);
+
+	this->worker_args.resize(nthreads);
+	for (int i = 0; i < nthreads; i++) {
+		this->worker_args[i] = WorkerArgs{ this, i };
+		std::string name = "WorkerThread" + std::to_string(i);
+		SDL_Thread *thread = SDL_CreateThread(worker_thread, name.c_str(), &this->worker_args[i]);
+		SDL_assert(thread);
+		this->threads.push_back(thread);
+	}
+	log_printf("Started %d worker threads", nthreads);
+}
+
+ThreadPool::~ThreadPool()
+{
+	this->quit = true;
+	for (int i = 0; i < this->threads.size(); i++)
+		SDL_SemPost(this->jobs_available);
+	for (SDL_Thread *thread : this->threads)
+		SDL_WaitThread(thread, nullptr);
+	SDL_DestroySemaphore(this->jobs_available);
+	SDL_DestroyCond(this->job_done);
+	SDL_DestroyMutex(this->job_done_mutex);
+}
+
+// Wakes up threads in wait_until(). Locking ensures that they don't miss it between checking and sleeping.
+void ThreadPool::notify_waiting_threads()
+{
+	SDL_LockMutex(this->job_done_mutex);
+	SDL_CondBroadcast(this->job_done);
+	SDL_UnlockMutex(this->job_done_mutex);
+}
+
+bool ThreadPool::submit(std::function<void()> job, JobPriority priority)
+{
+	LockFreeQueue<std::function<void()>>& queue = (priority == JobPriority::High) ? this->high_priority_jobs : this->low_priority_jobs;
+	if (!queue.push(std::move(job)))
+		return false;
+	SDL_SemPost(this->jobs_available);
+	if (priority == JobPriority::High)
+		this->notify_waiting_threads();  // they can help with it
+	return true;
+}
+
+bool ThreadPool::run_one_job(bool high_priority_only)
+{
+	std::function<void()> job;
+	if (this->high_priority_jobs.pop(job) || (!high_priority_only && this->low_priority_jobs.pop(job))) {
+		{
+			PROFILE_SCOPE("ThreadPool job");
+			job();
+		}
+		this->notify_waiting_threads();
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::wait_until(const std::function<bool()>& done)
+{
+	while (!done()) {
+		// Don't pick up low priority jobs, they could take a long time
+		if (this->run_one_job(true))
+			continue;
+
+		SDL_LockMutex(this->job_done_mutex);
+		if (!done())
+			SDL_CondWaitTimeout(this->job_done, this->job_done_mutex, 100);  // timeout just in case, like in worker_thread()
+		SDL_UnlockMutex(this->job_done_mutex);
+	}
+}
+
+void ThreadPool::wait(const std::atomic<int>& counter)
+{
+	this->wait_until([&counter]() { return counter.load() == 0; });
+}
+
+int ThreadPool::get_queue_length(JobPriority priority) const
+{
+	if (priority == JobPriority::High)
+		return this->high_priority_jobs.approximate_size();
+	return this->low_priority_jobs.approximate_size();
+}
+
+int ThreadPool::worker_thread(void *argsptr)
+{
+	// Not low priority, because the main thread often waits for high priority jobs
+	const WorkerArgs& args = *(const WorkerArgs *)argsptr;
+	ThreadPool *pool = args.pool;
+
+	char name[32];
+	std::snprintf(name, sizeof name, "Worker thread %d", args.index);
+	profiler_set_thread_name(name);
+
+	while (!pool->quit) {
+		/*
+		Semaphore count and number of jobs don't always match, because other
+		threads run jobs in wait() and pushing to the queue isn't atomic with
+		posting the semaphore. Run everything we can find, and with a timeout,
+		a job can't get stuck in the queue for long.
+		*/
+		SDL_SemWaitTimeout(pool->jobs_available, 100);
+		while (!pool->quit && pool->run_one_job(false)) { }
+	}
+
+	return 1234;  // ignored
+}
@@ -0,0 +1,58 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <SDL2/SDL.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "lockfree_queue.hpp"
+
+/*
+High priority jobs are something that a thread is waiting for right now.
+Low priority jobs are for preparing things in the background.
+Workers always take a high priority job if there is one.
+*/
+enum class JobPriority { Low, High };
+
+class ThreadPool {
+public:
+	// nthreads = 0 means one less than number of CPU cores, but at least one
+	ThreadPool(int nthreads);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+
+	// Returns false if the queue is full. Then you can run the job yourself.
+	bool submit(std::function<void()> job, JobPriority priority = JobPriority::Low);
+
+	/*
+	Runs high priority jobs on the calling thread until done() returns true, and
+	sleeps when there's nothing to run. done() is checked again whenever a job
+	finishes, so it should become true in a job.
+	*/
+	void wait_until(const std::function<bool()>& done);
+
+	// Same as above, until counter becomes zero
+	void wait(const std::atomic<int>& counter);
+
+	int get_number_of_threads() const { return this->threads.size(); }
+	int get_queue_length(JobPriority priority) const;
+
+private:
+	struct WorkerArgs { ThreadPool *pool; int index; };
+
+	bool run_one_job(bool high_priority_only);
+	void notify_waiting_threads();
+	static int worker_thread(void *argsptr);
+
+	LockFreeQueue<std::function<void()>> high_priority_jobs;
+	LockFreeQueue<std::function<void()>> low_priority_jobs;
+	SDL_sem *jobs_available;  // posted once for each submitted job
+	SDL_mutex *job_done_mutex;
+	SDL_cond *job_done;  // broadcast when a job finishes or a high priority job is submitted
+	std::atomic<bool> quit;
+	std::vector<SDL_Thread*> threads;
+	std::vector<WorkerArgs> worker_args;  // threads point into this, so never resized after starting them
+};
+
+#endif